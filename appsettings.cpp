@@ -19,6 +19,7 @@
 #include <glibmm/miscutils.h>
 #include <glibmm/keyfile.h>
 #include <vncdisplay.h>
+#include <algorithm>
 #include <iostream>
 
 AppSettings::AppSettings()
@@ -38,6 +39,7 @@ AppSettings::AppSettings()
     read_setting(config_file, "ConnectionDialog", "LossyCompression", "true");
     read_setting(config_file, "ConnectionDialog", "ColorDepth",
                  std::to_string(VNC_DISPLAY_DEPTH_COLOR_DEFAULT));
+    read_setting(config_file, "ConnectionDialog", "SshProfile", "default");
 
     read_setting(config_file, "Main", "CaptureKeyboard", "true");
     read_setting(config_file, "Main", "ScaledDisplay", "true");
@@ -46,6 +48,14 @@ AppSettings::AppSettings()
     read_setting(config_file, "Main", "AllowResize", "false");
     read_setting(config_file, "Main", "SaveSSHPassword", "false");
     read_setting(config_file, "Main", "SaveVNCCredentials", "false");
+    read_setting(config_file, "Main", "AutoReconnect", "false");
+    read_setting(config_file, "Main", "SSHConnectTimeout", "30");
+    read_setting(config_file, "Main", "SSHKeepaliveInterval", "5");
+    read_setting(config_file, "Main", "SSHKeepaliveCount", "3");
+    read_setting(config_file, "Main", "SSHSpareChannel", "false");
+    read_setting(config_file, "Main", "SSHSessions", "1");
+    read_setting(config_file, "Main", "SSHMaxWindow", std::to_string(16 * 1024 * 1024));
+    read_setting(config_file, "Main", "ScreenshotCompression", "6");
     read_setting(config_file, "Main", "WindowSize");
 }
 
@@ -135,6 +145,17 @@ void AppSettings::set_color_depth(const Glib::ustring &value)
     m_modified_keys.insert("ConnectionDialog/ColorDepth");
 }
 
+Glib::ustring AppSettings::get_ssh_profile() const
+{
+    return m_values.at("ConnectionDialog/SshProfile");
+}
+
+void AppSettings::set_ssh_profile(const Glib::ustring &value)
+{
+    m_values["ConnectionDialog/SshProfile"] = value;
+    m_modified_keys.insert("ConnectionDialog/SshProfile");
+}
+
 bool AppSettings::get_capture_keyboard() const
 {
     return get_bool("Main/CaptureKeyboard");
@@ -205,6 +226,98 @@ void AppSettings::set_save_vnc_credentials(bool save)
     set_bool("Main/SaveVNCCredentials", save);
 }
 
+bool AppSettings::get_auto_reconnect() const
+{
+    return get_bool("Main/AutoReconnect");
+}
+
+void AppSettings::set_auto_reconnect(bool enable)
+{
+    set_bool("Main/AutoReconnect", enable);
+}
+
+int AppSettings::get_ssh_connect_timeout() const
+{
+    auto value = std::strtol(m_values.at("Main/SSHConnectTimeout").c_str(), nullptr, 0);
+    return (value > 0) ? static_cast<int>(value) : 30;
+}
+
+void AppSettings::set_ssh_connect_timeout(int seconds)
+{
+    m_values["Main/SSHConnectTimeout"] = std::to_string(seconds);
+    m_modified_keys.insert("Main/SSHConnectTimeout");
+}
+
+int AppSettings::get_ssh_keepalive_interval() const
+{
+    auto value = std::strtol(m_values.at("Main/SSHKeepaliveInterval").c_str(), nullptr, 0);
+    return (value >= 0) ? static_cast<int>(value) : 0;
+}
+
+void AppSettings::set_ssh_keepalive_interval(int seconds)
+{
+    m_values["Main/SSHKeepaliveInterval"] = std::to_string(seconds);
+    m_modified_keys.insert("Main/SSHKeepaliveInterval");
+}
+
+int AppSettings::get_ssh_keepalive_count() const
+{
+    auto value = std::strtol(m_values.at("Main/SSHKeepaliveCount").c_str(), nullptr, 0);
+    return (value > 0) ? static_cast<int>(value) : 3;
+}
+
+void AppSettings::set_ssh_keepalive_count(int count)
+{
+    m_values["Main/SSHKeepaliveCount"] = std::to_string(count);
+    m_modified_keys.insert("Main/SSHKeepaliveCount");
+}
+
+bool AppSettings::get_ssh_spare_channel() const
+{
+    return get_bool("Main/SSHSpareChannel");
+}
+
+void AppSettings::set_ssh_spare_channel(bool enable)
+{
+    set_bool("Main/SSHSpareChannel", enable);
+}
+
+int AppSettings::get_ssh_sessions() const
+{
+    auto value = std::strtol(m_values.at("Main/SSHSessions").c_str(), nullptr, 0);
+    return (value > 0) ? static_cast<int>(value) : 1;
+}
+
+void AppSettings::set_ssh_sessions(int count)
+{
+    m_values["Main/SSHSessions"] = std::to_string(count);
+    m_modified_keys.insert("Main/SSHSessions");
+}
+
+uint32_t AppSettings::get_ssh_max_window() const
+{
+    auto value = std::strtoul(m_values.at("Main/SSHMaxWindow").c_str(), nullptr, 0);
+    return static_cast<uint32_t>(std::min<unsigned long>(value, UINT32_MAX / 2));
+}
+
+void AppSettings::set_ssh_max_window(uint32_t bytes)
+{
+    m_values["Main/SSHMaxWindow"] = std::to_string(bytes);
+    m_modified_keys.insert("Main/SSHMaxWindow");
+}
+
+int AppSettings::get_screenshot_compression() const
+{
+    auto value = std::strtol(m_values.at("Main/ScreenshotCompression").c_str(), nullptr, 0);
+    return static_cast<int>(std::min(std::max(value, 0L), 9L));
+}
+
+void AppSettings::set_screenshot_compression(int level)
+{
+    m_values["Main/ScreenshotCompression"] = std::to_string(level);
+    m_modified_keys.insert("Main/ScreenshotCompression");
+}
+
 std::tuple<int, int> AppSettings::get_window_size() const
 {
     auto pos_str = m_values.at("Main/WindowSize");
@@ -17,6 +17,7 @@
 #ifndef _APPSETTINGS_H
 #define _APPSETTINGS_H
 
+#include <cstdint>
 #include <tuple>
 #include <vector>
 #include <unordered_map>
@@ -56,6 +57,10 @@ public:
     Glib::ustring get_color_depth() const;
     void set_color_depth(const Glib::ustring &value);
 
+    // One of "default", "lan", "wan" or "low-bandwidth"
+    Glib::ustring get_ssh_profile() const;
+    void set_ssh_profile(const Glib::ustring &value);
+
     bool get_capture_keyboard() const;
     void set_capture_keyboard(bool enable);
 
@@ -77,6 +82,39 @@ public:
     bool get_save_vnc_credentials() const;
     void set_save_vnc_credentials(bool save);
 
+    bool get_auto_reconnect() const;
+    void set_auto_reconnect(bool enable);
+
+    // Seconds to wait for each SSH network round trip while connecting
+    int get_ssh_connect_timeout() const;
+    void set_ssh_connect_timeout(int seconds);
+
+    // Seconds between SSH keepalives (0 disables them), and how many can be
+    // missed before the connection is considered dead
+    int get_ssh_keepalive_interval() const;
+    void set_ssh_keepalive_interval(int seconds);
+    int get_ssh_keepalive_count() const;
+    void set_ssh_keepalive_count(int count);
+
+    // Open a forwarding channel ahead of time while an automatic reconnect
+    // is pending, so it doesn't wait for a round trip to the SSH server.
+    // Off by default, as the VNC server sees the channel as a new client.
+    bool get_ssh_spare_channel() const;
+    void set_ssh_spare_channel(bool enable);
+
+    // Parallel SSH sessions to spread forwarded connections across
+    int get_ssh_sessions() const;
+    void set_ssh_sessions(int count);
+
+    // Upper limit for SSH channel receive window auto-tuning, in bytes.
+    // Anything below twice libssh's own window disables tuning.
+    uint32_t get_ssh_max_window() const;
+    void set_ssh_max_window(uint32_t bytes);
+
+    // PNG compression level for screenshots, from 0 (fastest) to 9
+    int get_screenshot_compression() const;
+    void set_screenshot_compression(int level);
+
     std::tuple<int, int> get_window_size() const;
     void set_window_size(int w, int h);
 
@@ -0,0 +1,254 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "impairment.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <random>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+#define PIPE_READ_SIZE  (16 * 1024)
+
+// Data in flight is bounded, so the sender still sees backpressure from a
+// slow link instead of filling our memory
+#define PIPE_MIN_QUEUE  (256 * 1024)
+
+// One direction of a relayed connection:  A reader thread stamps each
+// chunk with the time it may be delivered, and a writer thread sends it
+// when that time comes.
+struct ImpairedLink::Pipe
+{
+    struct Chunk
+    {
+        Clock::time_point deliver_at;
+        std::vector<char> data;
+    };
+
+    const Impairment &m_impairment;
+    int m_from;
+    int m_to;
+    const std::atomic_bool &m_stop;
+    std::mt19937 m_random;
+
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    std::deque<Chunk> m_queue;
+    size_t m_queued;
+    size_t m_max_queued;
+    bool m_eof;
+
+    Clock::time_point m_last_delivery;
+    Clock::time_point m_start;
+    std::thread m_reader;
+    std::thread m_writer;
+
+    Pipe(const Impairment &impairment, int from, int to, const std::atomic_bool &stop)
+        : m_impairment(impairment), m_from(from), m_to(to), m_stop(stop),
+          m_random(std::random_device()()), m_queued(0), m_eof(false),
+          m_last_delivery(Clock::now()), m_start(Clock::now())
+    {
+        // Enough to keep the link busy for one delay period
+        m_max_queued = std::max<uint64_t>(PIPE_MIN_QUEUE,
+                                          impairment.rate * impairment.delay_ms / 1000);
+        m_reader = std::thread([this]() { read_loop(); });
+        m_writer = std::thread([this]() { write_loop(); });
+    }
+
+    ~Pipe()
+    {
+        m_changed.notify_all();
+        m_reader.join();
+        m_writer.join();
+    }
+
+    Clock::time_point delivery_time(Clock::time_point now, size_t size)
+    {
+        auto deliver_at = now + std::chrono::milliseconds(m_impairment.delay_ms);
+        if (m_impairment.jitter_ms) {
+            std::uniform_int_distribution<int> jitter(-static_cast<int>(m_impairment.jitter_ms),
+                                                      static_cast<int>(m_impairment.jitter_ms));
+            deliver_at += std::chrono::milliseconds(jitter(m_random));
+        }
+
+        // Stay in order, and leave the previous chunk time to get through
+        // the bandwidth cap
+        auto earliest = m_last_delivery;
+        if (m_impairment.rate) {
+            earliest += std::chrono::microseconds(size * 1000000 / m_impairment.rate);
+        }
+        deliver_at = std::max(deliver_at, earliest);
+
+        if (m_impairment.burst_period_ms && m_impairment.burst_hold_ms) {
+            const auto period = std::chrono::milliseconds(m_impairment.burst_period_ms);
+            const auto hold = std::chrono::milliseconds(m_impairment.burst_hold_ms);
+            auto phase = (deliver_at - m_start) % period;
+            if (phase < hold)
+                deliver_at += hold - phase;
+        }
+
+        m_last_delivery = deliver_at;
+        return deliver_at;
+    }
+
+    void read_loop()
+    {
+        std::vector<char> buffer(PIPE_READ_SIZE);
+        while (!m_stop) {
+            struct pollfd pfd = { m_from, POLLIN, 0 };
+            int ready = poll(&pfd, 1, 100);
+            if (ready < 0 && errno != EINTR)
+                break;
+            if (ready <= 0)
+                continue;
+
+            ssize_t len = recv(m_from, buffer.data(), buffer.size(), 0);
+            if (len <= 0)
+                break;
+
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_changed.wait(lock, [this]() { return m_queued < m_max_queued || m_stop; });
+            Chunk chunk;
+            chunk.deliver_at = delivery_time(Clock::now(), len);
+            chunk.data.assign(buffer.begin(), buffer.begin() + len);
+            m_queued += len;
+            m_queue.push_back(std::move(chunk));
+            m_changed.notify_all();
+        }
+
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_eof = true;
+        m_changed.notify_all();
+    }
+
+    void write_loop()
+    {
+        for (;;) {
+            Chunk chunk;
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_changed.wait(lock, [this]() { return !m_queue.empty() || m_eof || m_stop; });
+                if (m_queue.empty() || m_stop)
+                    break;
+                auto deliver_at = m_queue.front().deliver_at;
+                if (m_changed.wait_until(lock, deliver_at, [this]() { return bool(m_stop); }))
+                    break;
+                chunk = std::move(m_queue.front());
+                m_queue.pop_front();
+                m_queued -= chunk.data.size();
+                m_changed.notify_all();
+            }
+
+            const char *data = chunk.data.data();
+            size_t len = chunk.data.size();
+            while (len > 0) {
+                ssize_t sent = send(m_to, data, len, MSG_NOSIGNAL);
+                if (sent <= 0)
+                    return;
+                data += sent;
+                len -= sent;
+            }
+        }
+
+        // Pass the EOF on, so the other side sees the connection close
+        shutdown(m_to, SHUT_WR);
+    }
+};
+
+ImpairedLink::ImpairedLink(const Impairment &impairment)
+    : m_impairment(impairment), m_listener(-1), m_target_port(), m_stop(false)
+{
+}
+
+ImpairedLink::~ImpairedLink()
+{
+    m_stop = true;
+    if (m_listener >= 0)
+        shutdown(m_listener, SHUT_RDWR);
+    if (m_accept_thread.joinable())
+        m_accept_thread.join();
+    m_pipes.clear();
+    for (int fd : m_fds)
+        close(fd);
+    if (m_listener >= 0)
+        close(m_listener);
+}
+
+int ImpairedLink::start(int target_port)
+{
+    m_target_port = target_port;
+
+    struct sockaddr_in addr = { };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    m_listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_listener < 0
+            || bind(m_listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+            || listen(m_listener, 4) < 0
+            || getsockname(m_listener, reinterpret_cast<sockaddr *>(&addr), &addr_len) < 0) {
+        std::cerr << "Error listening for impaired link: " << strerror(errno) << std::endl;
+        return 0;
+    }
+
+    m_accept_thread = std::thread([this]() { accept_connections(); });
+    return ntohs(addr.sin_port);
+}
+
+void ImpairedLink::accept_connections()
+{
+    while (!m_stop) {
+        int client = accept(m_listener, nullptr, nullptr);
+        if (client < 0)
+            break;
+
+        struct sockaddr_in addr = { };
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_target_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int server = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+            std::cerr << "Error connecting impaired link: " << strerror(errno) << std::endl;
+            close(server);
+            close(client);
+            continue;
+        }
+
+        // Delays come from the impairment only, not from Nagle
+        int nodelay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        // The fds are only closed with the link, once both pipes are done
+        m_fds.push_back(client);
+        m_fds.push_back(server);
+        m_pipes.push_back(std::make_unique<Pipe>(m_impairment, client, server, m_stop));
+        m_pipes.push_back(std::make_unique<Pipe>(m_impairment, server, client, m_stop));
+    }
+}
@@ -0,0 +1,79 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IMPAIRMENT_H
+#define _IMPAIRMENT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Link conditions applied to each direction separately
+struct Impairment
+{
+    // One-way delay, plus up to +/- jitter_ms of random variation.  Data
+    // is never reordered, since it's a TCP stream.
+    unsigned delay_ms = 0;
+    unsigned jitter_ms = 0;
+
+    // Bandwidth cap in bytes per second, or 0 for none
+    uint64_t rate = 0;
+
+    // Every burst_period_ms, hold everything for burst_hold_ms and then
+    // release it at once, like a radio link waking up or a congested queue
+    unsigned burst_period_ms = 0;
+    unsigned burst_hold_ms = 0;
+
+    bool active() const
+    {
+        return delay_ms || jitter_ms || rate || (burst_period_ms && burst_hold_ms);
+    }
+};
+
+// A TCP relay on the loopback interface, which forwards each connection it
+// accepts to target_port while applying an Impairment.  Needs no special
+// privileges, so the SSH connection of a test or benchmark can simply be
+// pointed at it instead of the server.
+class ImpairedLink
+{
+public:
+    explicit ImpairedLink(const Impairment &impairment);
+    ~ImpairedLink();
+
+    ImpairedLink(const ImpairedLink &) = delete;
+    ImpairedLink &operator=(const ImpairedLink &) = delete;
+
+    // Returns the local port to connect to, or 0 on error
+    int start(int target_port);
+
+private:
+    struct Pipe;
+
+    Impairment m_impairment;
+    int m_listener;
+    int m_target_port;
+    std::atomic_bool m_stop;
+    std::thread m_accept_thread;
+    std::vector<std::unique_ptr<Pipe>> m_pipes;
+    std::vector<int> m_fds;
+
+    void accept_connections();
+};
+
+#endif
@@ -0,0 +1,541 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Throughput and latency benchmark for SshTunnel::forward_port().
+//
+// An in-process libssh server stands in for sshd, and answers every
+// channel itself with a synthetic RFB-like peer:  Each request carries a
+// header of two big-endian 32-bit sizes (reply size, payload size) followed
+// by the payload, and is answered with a reply of the requested size.
+// Small requests with large replies behave like framebuffer updates, large
+// payloads like clipboard or file uploads, and small ones both ways like
+// input events.
+//
+// With --sessions=N, the tunnel is striped over N SSH sessions as with
+// Main/SSHSessions, and the server handles each session on its own thread,
+// to measure how throughput scales with the clients spread across them.
+//
+// The --delay-ms, --jitter-ms, --rate, --burst-period-ms and
+// --burst-hold-ms options route the SSH connection through an ImpairedLink,
+// to see how forwarding holds up over a WAN.
+//
+// Replies carry a repeating byte pattern, which --verify=1 has the clients
+// check, so a run also fails if the tunnel drops, duplicates or reorders
+// anything.
+//
+// Exits with 77 (skipped) if GTK can't be initialized, since SshTunnel
+// needs a parent window for its dialogs.
+
+#include "impairment.h"
+#include "../sshtunnel.h"
+
+#include <gtkmm/main.h>
+#include <gtkmm/window.h>
+#include <libssh/callbacks.h>
+#include <libssh/server.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define REQUEST_HEADER_SIZE 8
+#define IO_CHUNK_SIZE       (64 * 1024)
+
+// Prime, so the pattern never lines up with chunk or buffer sizes
+#define PATTERN_PERIOD      251
+
+// IO_CHUNK_SIZE bytes of the reply pattern from any offset into it
+static const std::vector<char> &reply_pattern()
+{
+    static const std::vector<char> pattern = []() {
+        std::vector<char> bytes(IO_CHUNK_SIZE + PATTERN_PERIOD);
+        for (size_t i = 0; i < bytes.size(); ++i)
+            bytes[i] = static_cast<char>(i % PATTERN_PERIOD);
+        return bytes;
+    }();
+    return pattern;
+}
+
+struct Options
+{
+    uint32_t upstream = 64;
+    uint32_t downstream = 64;
+    int clients = 1;
+    int sessions = 1;
+    int seconds = 5;
+    bool verify = false;
+    Impairment impairment;
+};
+
+static bool parse_options(int argc, char *argv[], Options &options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        if (eq == std::string::npos)
+            return false;
+        auto name = arg.substr(0, eq);
+        auto value = std::strtoul(arg.c_str() + eq + 1, nullptr, 0);
+        if (name == "--up")
+            options.upstream = value;
+        else if (name == "--down")
+            options.downstream = std::max<uint32_t>(value, 1);
+        else if (name == "--clients")
+            options.clients = std::max<int>(value, 1);
+        else if (name == "--sessions")
+            options.sessions = std::max<int>(value, 1);
+        else if (name == "--seconds")
+            options.seconds = std::max<int>(value, 1);
+        else if (name == "--verify")
+            options.verify = (value != 0);
+        else if (name == "--delay-ms")
+            options.impairment.delay_ms = value;
+        else if (name == "--jitter-ms")
+            options.impairment.jitter_ms = value;
+        else if (name == "--rate")
+            options.impairment.rate = value;
+        else if (name == "--burst-period-ms")
+            options.impairment.burst_period_ms = value;
+        else if (name == "--burst-hold-ms")
+            options.impairment.burst_hold_ms = value;
+        else
+            return false;
+    }
+    return true;
+}
+
+class BenchServer
+{
+public:
+    BenchServer() : m_bind(), m_listener(-1), m_port(), m_stop(false) { }
+
+    ~BenchServer()
+    {
+        // Also unblocks accept() if the client never connected
+        m_stop = true;
+        if (m_listener >= 0)
+            shutdown(m_listener, SHUT_RDWR);
+        if (m_thread.joinable())
+            m_thread.join();
+        for (auto &thread : m_session_threads)
+            thread.join();
+        if (m_listener >= 0)
+            close(m_listener);
+        if (m_bind)
+            ssh_bind_free(m_bind);
+    }
+
+    // Accepts this many sessions, each served by its own thread
+    bool start(int sessions)
+    {
+        ssh_key host_key;
+        if (ssh_pki_generate(SSH_KEYTYPE_ED25519, 0, &host_key) != SSH_OK) {
+            std::cerr << "Error generating host key" << std::endl;
+            return false;
+        }
+
+        m_bind = ssh_bind_new();
+        ssh_bind_options_set(m_bind, SSH_BIND_OPTIONS_IMPORT_KEY, host_key);
+
+        // Listen ourselves, so the OS can pick a free port
+        struct sockaddr_in addr = { };
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len = sizeof(addr);
+        m_listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (m_listener < 0
+                || bind(m_listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+                || listen(m_listener, sessions) < 0
+                || getsockname(m_listener, reinterpret_cast<sockaddr *>(&addr), &addr_len) < 0) {
+            std::cerr << "Error listening: " << strerror(errno) << std::endl;
+            return false;
+        }
+        m_port = ntohs(addr.sin_port);
+
+        m_thread = std::thread([this, sessions]() { accept_sessions(sessions); });
+        return true;
+    }
+
+    int port() const { return m_port; }
+
+private:
+    struct Channel
+    {
+        ssh_channel channel;
+        struct ssh_channel_callbacks_struct callbacks;
+        std::string pending;
+        bool closed;
+    };
+
+    // Only used by the session's own thread
+    typedef std::vector<std::unique_ptr<Channel>> ChannelList;
+
+    ssh_bind m_bind;
+    int m_listener;
+    int m_port;
+    std::atomic_bool m_stop;
+    std::thread m_thread;
+    std::vector<std::thread> m_session_threads;
+
+    void accept_sessions(int count)
+    {
+        for (int i = 0; i < count; ++i) {
+            int fd = accept(m_listener, nullptr, nullptr);
+            if (fd < 0 || m_stop)
+                return;
+            ssh_session session = ssh_new();
+            if (ssh_bind_accept_fd(m_bind, session, fd) != SSH_OK) {
+                std::cerr << "Error accepting benchmark session: "
+                          << ssh_get_error(session) << std::endl;
+                ssh_free(session);
+                return;
+            }
+            m_session_threads.emplace_back([this, session]() { serve(session); });
+        }
+    }
+
+    void serve(ssh_session session)
+    {
+        if (ssh_handle_key_exchange(session) != SSH_OK) {
+            std::cerr << "Error accepting benchmark session: "
+                      << ssh_get_error(session) << std::endl;
+            ssh_free(session);
+            return;
+        }
+        ChannelList channels;
+        ssh_set_message_callback(session, &BenchServer::handle_message, &channels);
+
+        ssh_event event = ssh_event_new();
+        ssh_event_add_session(event, session);
+        while (!m_stop && ssh_is_connected(session)) {
+            ssh_event_dopoll(event, 100);
+
+            // Replies are written here rather than from the callbacks, since
+            // blocking writes dispatch more packets while they wait for the
+            // window.  Channels may be added meanwhile, so go by index.
+            for (size_t i = 0; i < channels.size(); ++i)
+                answer(*channels[i]);
+            channels.erase(std::remove_if(channels.begin(), channels.end(),
+                                          [](const std::unique_ptr<Channel> &channel) {
+                return channel->closed;
+            }), channels.end());
+        }
+
+        channels.clear();
+        ssh_event_remove_session(event, session);
+        ssh_event_free(event);
+        ssh_disconnect(session);
+        ssh_free(session);
+    }
+
+    void answer(Channel &channel)
+    {
+        const auto &pattern = reply_pattern();
+        while (!channel.closed && channel.pending.size() >= REQUEST_HEADER_SIZE) {
+            uint32_t sizes[2];
+            memcpy(sizes, channel.pending.data(), sizeof(sizes));
+            uint32_t reply_size = ntohl(sizes[0]);
+            uint32_t payload_size = ntohl(sizes[1]);
+            if (channel.pending.size() < REQUEST_HEADER_SIZE + payload_size)
+                break;
+            channel.pending.erase(0, REQUEST_HEADER_SIZE + payload_size);
+
+            uint32_t offset = 0;
+            while (offset < reply_size) {
+                uint32_t chunk = std::min<uint32_t>(reply_size - offset, IO_CHUNK_SIZE);
+                int written = ssh_channel_write(channel.channel,
+                                                &pattern[offset % PATTERN_PERIOD], chunk);
+                if (written <= 0) {
+                    channel.closed = true;
+                    break;
+                }
+                offset += written;
+            }
+        }
+        if (channel.closed) {
+            ssh_channel_close(channel.channel);
+            ssh_channel_free(channel.channel);
+        }
+    }
+
+    static int handle_message(ssh_session, ssh_message message, void *userdata)
+    {
+        auto channels = reinterpret_cast<ChannelList *>(userdata);
+        switch (ssh_message_type(message)) {
+        case SSH_REQUEST_SERVICE:
+            ssh_message_service_reply_success(message);
+            return 0;
+
+        case SSH_REQUEST_AUTH:
+            // Nothing to protect here
+            ssh_message_auth_reply_success(message, 0);
+            return 0;
+
+        case SSH_REQUEST_CHANNEL_OPEN:
+            if (ssh_message_subtype(message) == SSH_CHANNEL_DIRECT_TCPIP)
+                return open_channel(*channels, message) ? 0 : 1;
+            return 1;
+
+        default:
+            return 1;
+        }
+    }
+
+    static bool open_channel(ChannelList &channels, ssh_message message)
+    {
+        auto channel = std::make_unique<Channel>();
+        channel->closed = false;
+        channel->channel = ssh_message_channel_request_open_reply_accept(message);
+        if (!channel->channel)
+            return false;
+
+        ssh_callbacks_init(&channel->callbacks);
+        channel->callbacks.userdata = channel.get();
+        channel->callbacks.channel_data_function = &BenchServer::channel_data;
+        channel->callbacks.channel_eof_function = &BenchServer::channel_eof;
+        channel->callbacks.channel_close_function = &BenchServer::channel_eof;
+        ssh_set_channel_callbacks(channel->channel, &channel->callbacks);
+        channels.push_back(std::move(channel));
+        return true;
+    }
+
+    static int channel_data(ssh_session, ssh_channel, void *data, uint32_t len,
+                            int, void *userdata)
+    {
+        auto channel = reinterpret_cast<Channel *>(userdata);
+        channel->pending.append(reinterpret_cast<const char *>(data), len);
+        return static_cast<int>(len);
+    }
+
+    static void channel_eof(ssh_session, ssh_channel, void *userdata)
+    {
+        reinterpret_cast<Channel *>(userdata)->closed = true;
+    }
+};
+
+struct ClientResult
+{
+    uint64_t bytes = 0;
+    std::vector<uint32_t> rtt_usec;
+    bool failed = false;
+    bool corrupt = false;
+};
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, 0);
+        if (sent <= 0)
+            return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static void run_client(int port, const Options &options,
+                       std::chrono::steady_clock::time_point deadline, ClientResult &result)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        result.failed = true;
+        close(fd);
+        return;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    std::vector<char> request(REQUEST_HEADER_SIZE + options.upstream);
+    uint32_t sizes[2] = { htonl(options.downstream), htonl(options.upstream) };
+    memcpy(request.data(), sizes, sizeof(sizes));
+    std::vector<char> reply(IO_CHUNK_SIZE);
+
+    while (std::chrono::steady_clock::now() < deadline) {
+        auto start = std::chrono::steady_clock::now();
+        if (!send_all(fd, request.data(), request.size())) {
+            result.failed = true;
+            break;
+        }
+        uint32_t remaining = options.downstream;
+        while (remaining > 0) {
+            ssize_t received = recv(fd, reply.data(),
+                                    std::min<size_t>(remaining, reply.size()), 0);
+            if (received <= 0) {
+                result.failed = true;
+                break;
+            }
+            const uint32_t offset = options.downstream - remaining;
+            if (options.verify && memcmp(reply.data(),
+                                         &reply_pattern()[offset % PATTERN_PERIOD],
+                                         received) != 0) {
+                result.corrupt = true;
+                result.failed = true;
+                break;
+            }
+            remaining -= received;
+        }
+        if (result.failed)
+            break;
+
+        result.bytes += request.size() + options.downstream;
+        result.rtt_usec.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - start).count());
+    }
+    close(fd);
+}
+
+static ssh_session connect_session(int port)
+{
+    ssh_session session = ssh_new();
+    ssh_options_set(session, SSH_OPTIONS_HOST, "127.0.0.1");
+    ssh_options_set(session, SSH_OPTIONS_PORT, &port);
+    ssh_options_set(session, SSH_OPTIONS_USER, "bench");
+    if (ssh_connect(session) != SSH_OK
+            || ssh_userauth_none(session, nullptr) != SSH_AUTH_SUCCESS) {
+        std::cerr << "Error connecting to benchmark server: "
+                  << ssh_get_error(session) << std::endl;
+        ssh_free(session);
+        return nullptr;
+    }
+    return session;
+}
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+           + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--up=BYTES] [--down=BYTES] [--clients=N] [--sessions=N] [--seconds=N]"
+                     " [--verify=0|1]"
+                     " [--delay-ms=N] [--jitter-ms=N] [--rate=BYTES_PER_SEC]"
+                     " [--burst-period-ms=N] [--burst-hold-ms=N]" << std::endl;
+        return 1;
+    }
+
+    int gtk_argc = 1;
+    if (!gtk_init_check(&gtk_argc, &argv)) {
+        std::cerr << "No display available, skipping" << std::endl;
+        return 77;
+    }
+    Gtk::Main::init_gtkmm_internals();
+    Gtk::Window parent;
+
+    BenchServer server;
+    if (!server.start(options.sessions))
+        return 1;
+
+    int port = server.port();
+    ImpairedLink link(options.impairment);
+    if (options.impairment.active()) {
+        port = link.start(port);
+        if (port == 0)
+            return 1;
+    }
+
+    ssh_session session = connect_session(port);
+    if (!session)
+        return 1;
+    SshTunnel tunnel(parent);
+    if (!tunnel.attach(session, "127.0.0.1", "bench"))
+        return 1;
+    for (int i = 1; i < options.sessions; ++i) {
+        session = connect_session(port);
+        if (!session || !tunnel.attach_stripe(session))
+            return 1;
+    }
+    guint16 local_port = tunnel.forward_port("127.0.0.1", 5900);
+    if (local_port == 0)
+        return 1;
+
+    std::vector<ClientResult> results(options.clients);
+    std::vector<std::thread> clients;
+    const double cpu_start = cpu_seconds();
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = start + std::chrono::seconds(options.seconds);
+    for (int i = 0; i < options.clients; ++i) {
+        clients.emplace_back(run_client, local_port, std::cref(options), deadline,
+                             std::ref(results[i]));
+    }
+    for (auto &client : clients)
+        client.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    const double cpu_used = cpu_seconds() - cpu_start;
+
+    uint64_t bytes = 0;
+    std::vector<uint32_t> rtt_usec;
+    bool corrupt = false;
+    for (const auto &result : results) {
+        if (result.corrupt)
+            std::cerr << "A client received corrupted data" << std::endl;
+        else if (result.failed)
+            std::cerr << "A client failed before the deadline" << std::endl;
+        corrupt = corrupt || result.corrupt;
+        bytes += result.bytes;
+        rtt_usec.insert(rtt_usec.end(), result.rtt_usec.begin(), result.rtt_usec.end());
+    }
+    if (rtt_usec.empty()) {
+        std::cerr << "No requests completed" << std::endl;
+        return 1;
+    }
+    if (corrupt)
+        return 1;
+    std::sort(rtt_usec.begin(), rtt_usec.end());
+
+    // CPU covers the whole process:  Clients, forwarder and server alike
+    const double gigabytes = bytes / 1e9;
+    std::cout << "up=" << options.upstream << " down=" << options.downstream
+              << " clients=" << options.clients << " sessions=" << options.sessions << ": "
+              << (bytes / 1e6 / elapsed.count()) << " MB/s, "
+              << "RTT p50 " << rtt_usec[rtt_usec.size() / 2] << " us, "
+              << "p99 " << rtt_usec[rtt_usec.size() * 99 / 100] << " us, "
+              << (gigabytes > 0.0 ? cpu_used / gigabytes : 0.0) << " CPU s/GB"
+              << std::endl;
+
+    auto stats = tunnel.stats();
+    std::cout << "  " << stats.local_reads << " local reads in " << stats.channel_writes
+              << " channel writes, " << stats.upstream_stalls << "/"
+              << stats.downstream_stalls << " up/down stalls, window "
+              << stats.window_size << ", " << stats.wakeups << " wakeups" << std::endl;
+
+    tunnel.disconnect();
+    return 0;
+}
@@ -16,19 +16,30 @@
 
 #include "vncdisplaymm.h"
 #include "vncconnectdialog.h"
+#include "rfbcapture.h"
+#include "sessionplayer.h"
 
 #include <glibmm/optioncontext.h>
+#include <glibmm/main.h>
 #include <gtkmm/application.h>
 #include <gtkmm/messagedialog.h>
 #include <libssh/callbacks.h>
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 
 #ifdef _WIN32
 #include <glibmm/miscutils.h>
-#include <cstdio>
 #endif
 
-static bool show_connect_dialog(Vnc::DisplayWindow &vnc, SshTunnel &ssh)
+// Automatic reconnection retries with exponential backoff, then falls back
+// to the connect dialog
+#define RECONNECT_DELAY_INITIAL_MS  250
+#define RECONNECT_DELAY_MAX_MS      30000
+#define RECONNECT_MAX_ATTEMPTS      10
+
+static bool show_connect_dialog(Vnc::DisplayWindow &vnc, SshTunnel &ssh,
+                                Vnc::ConnectParams &params)
 {
     Vnc::ConnectDialog dialog(vnc);
     dialog.show_all();
@@ -40,6 +51,7 @@ static bool show_connect_dialog(Vnc::DisplayWindow &vnc, SshTunnel &ssh)
             break;
 
         if (dialog.configure(vnc, ssh)) {
+            params = dialog.get_params();
             vnc.show_all();
             return true;
         }
@@ -62,11 +74,17 @@ class GsshvncApp : public Gtk::Application
 public:
     GsshvncApp()
         : Gtk::Application("net.zrax.gsshvnc",
-                           Gio::APPLICATION_HANDLES_COMMAND_LINE | Gio::APPLICATION_NON_UNIQUE)
+                           Gio::APPLICATION_HANDLES_COMMAND_LINE | Gio::APPLICATION_NON_UNIQUE),
+          m_last_params(), m_reconnect_attempts(), m_socks(false), m_port_first(),
+          m_port_last(), m_replay_fast(false)
     { }
 
     ~GsshvncApp() override
     {
+        m_reconnect_timer.disconnect();
+        m_replay.reset();
+        if (m_player)
+            remove_window(*m_player);
         if (m_ssh)
             m_ssh->disconnect();
         if (m_vnc)
@@ -81,6 +99,47 @@ protected:
         static const char help_msg[] = "Run 'gsshvnc --help' to see a full list of available command line options";
 
         Glib::OptionContext context(name);
+        Glib::OptionGroup main_group("gsshvnc", "gsshvnc Options");
+        Glib::OptionEntry forward_entry;
+        forward_entry.set_long_name("forward");
+        forward_entry.set_arg_description("HOST:PORT");
+        forward_entry.set_description("Also forward a local port to HOST:PORT over the SSH session (may be repeated)");
+        main_group.add_entry(forward_entry, m_forward_targets);
+        Glib::OptionEntry socks_entry;
+        socks_entry.set_long_name("socks");
+        socks_entry.set_description("Also run a SOCKS5 proxy over the SSH session, on a Unix socket only you can use");
+        main_group.add_entry(socks_entry, m_socks);
+        Glib::ustring local_ports;
+        Glib::OptionEntry local_ports_entry;
+        local_ports_entry.set_long_name("local-ports");
+        local_ports_entry.set_arg_description("FIRST-LAST");
+        local_ports_entry.set_description("Only use local ports from FIRST to LAST for --forward (default: any free port)");
+        main_group.add_entry(local_ports_entry, local_ports);
+        Glib::OptionEntry capture_entry;
+        capture_entry.set_long_name("capture");
+        capture_entry.set_arg_description("FILE");
+        capture_entry.set_description("Record what the VNC server sends through the SSH tunnel to FILE");
+        main_group.add_entry_filename(capture_entry, m_capture_path);
+        Glib::OptionEntry replay_entry;
+        replay_entry.set_long_name("replay");
+        replay_entry.set_arg_description("FILE");
+        replay_entry.set_description("Play back a recording made with --capture instead of connecting");
+        main_group.add_entry_filename(replay_entry, m_replay_path);
+        Glib::OptionEntry replay_fast_entry;
+        replay_fast_entry.set_long_name("replay-fast");
+        replay_fast_entry.set_description("Play back as fast as possible instead of in real time");
+        main_group.add_entry(replay_fast_entry, m_replay_fast);
+        Glib::OptionEntry record_entry;
+        record_entry.set_long_name("record-session");
+        record_entry.set_arg_description("FILE");
+        record_entry.set_description("Record what the display shows to FILE, for review with --play-session");
+        main_group.add_entry_filename(record_entry, m_record_path);
+        Glib::OptionEntry play_entry;
+        play_entry.set_long_name("play-session");
+        play_entry.set_arg_description("FILE");
+        play_entry.set_description("Review a session recording instead of connecting");
+        main_group.add_entry_filename(play_entry, m_play_path);
+        context.set_main_group(main_group);
         context.add_group(Vnc::DisplayWindow::option_group());
         Glib::OptionGroup gtk_group(gtk_get_option_group(true));
         context.add_group(gtk_group);
@@ -95,17 +154,72 @@ protected:
             std::cerr << err.what() << "\n" << help_msg << std::endl;
             return 1;
         }
+        for (const auto &target : m_forward_targets) {
+            Glib::ustring host;
+            int port;
+            if (!parse_forward_target(target, host, port)) {
+                std::cerr << "Invalid forward target: " << target << "\n"
+                          << help_msg << std::endl;
+                return 1;
+            }
+        }
+        if (!local_ports.empty()) {
+            unsigned int first, last;
+            char extra;
+            if (sscanf(local_ports.c_str(), "%u-%u%c", &first, &last, &extra) != 2
+                    || first == 0 || first > 65535 || last == 0 || last > 65535) {
+                std::cerr << "Invalid local port range: " << local_ports << "\n"
+                          << help_msg << std::endl;
+                return 1;
+            }
+            m_port_first = first;
+            m_port_last = last;
+        }
         activate();
         return 0;
     }
 
     void on_activate() override
     {
+        if (!m_play_path.empty()) {
+            m_player = std::make_unique<SessionPlayer>();
+            add_window(*m_player);
+            if (!m_player->open(m_play_path)) {
+                Gtk::MessageDialog msg_dialog(*m_player, "Failed to open session recording",
+                                              false, Gtk::MESSAGE_ERROR);
+                (void)msg_dialog.run();
+                quit();
+                return;
+            }
+            m_player->show_all();
+            return;
+        }
+
         m_vnc = std::make_unique<Vnc::DisplayWindow>();
         m_ssh = std::make_unique<SshTunnel>(*m_vnc);
+        m_ssh->set_capture_path(m_capture_path);
+        m_ssh->set_local_port_range(m_port_first, m_port_last);
         add_window(*m_vnc);
+        if (!m_record_path.empty() && !m_vnc->start_recording(m_record_path)) {
+            Gtk::MessageDialog msg_dialog(*m_vnc, "Failed to start session recording",
+                                          false, Gtk::MESSAGE_ERROR);
+            (void)msg_dialog.run();
+            quit();
+            return;
+        }
 
-        if (!show_connect_dialog(*m_vnc, *m_ssh)) {
+        if (!m_replay_path.empty()) {
+            m_replay = std::make_unique<RfbReplay>();
+            int replay_fd = m_replay->start(m_replay_path, !m_replay_fast);
+            if (replay_fd < 0 || !m_vnc->open_fd(replay_fd, "replay")) {
+                Gtk::MessageDialog msg_dialog(*m_vnc, "Failed to play back RFB capture",
+                                              false, Gtk::MESSAGE_ERROR);
+                (void)msg_dialog.run();
+                quit();
+                return;
+            }
+            m_vnc->show_all();
+        } else if (!connect_dialog()) {
             quit();
             return;
         }
@@ -115,17 +229,167 @@ protected:
             return false;
         });
         m_vnc->signal_connection_lost().connect([this]() {
-            m_ssh->disconnect();
+            // Keep the SSH session if only the VNC connection went away
+            if (m_ssh->is_alive())
+                m_ssh->close_forward_fds();
+            else
+                m_ssh->disconnect();
+        });
+        m_ssh->signal_transport_lost().connect([this](SshTunnel::LinkFailure reason,
+                                                      const Glib::ustring &message) {
+            Glib::ustring text;
+            switch (reason) {
+            case SshTunnel::LINK_TIMEOUT:
+                text = "SSH connection timed out";
+                break;
+            case SshTunnel::LINK_CLOSED:
+                text = "SSH connection closed by server";
+                break;
+            default:
+                text = Glib::ustring::compose("SSH connection lost: %1", message);
+                break;
+            }
+            m_vnc->transport_lost(text);
         });
         m_vnc->signal_want_reconnect().connect([this]() {
-            if (!show_connect_dialog(*m_vnc, *m_ssh))
+            // Try the last settings directly if the SSH session survived
+            if (m_ssh->is_alive() && reconnect(true))
+                return;
+            if (!connect_dialog())
                 quit();
         });
+        m_vnc->signal_auto_reconnect().connect([this]() {
+            schedule_reconnect();
+        });
+        m_vnc->signal_reconnected().connect([this]() {
+            m_reconnect_attempts = 0;
+            m_ssh->set_reconnect_pending(false);
+        });
     }
 
 private:
     std::unique_ptr<Vnc::DisplayWindow> m_vnc;
     std::unique_ptr<SshTunnel> m_ssh;
+    Vnc::ConnectParams m_last_params;
+    unsigned int m_reconnect_attempts;
+    sigc::connection m_reconnect_timer;
+
+    std::vector<Glib::ustring> m_forward_targets;
+    bool m_socks;
+    guint16 m_port_first, m_port_last;
+
+    std::string m_capture_path;
+    std::string m_replay_path;
+    bool m_replay_fast;
+    std::unique_ptr<RfbReplay> m_replay;
+
+    std::string m_record_path;
+    std::string m_play_path;
+    std::unique_ptr<SessionPlayer> m_player;
+
+    // "unix:" and "exec:" targets are passed on whole, as forward_port()
+    // understands them too
+    static bool parse_forward_target(const Glib::ustring &target, Glib::ustring &host,
+                                     int &port)
+    {
+        if (target.compare(0, 5, "unix:") == 0 || target.compare(0, 5, "exec:") == 0) {
+            host = target;
+            port = 0;
+            return target.size() > 5;
+        }
+
+        auto colon = target.rfind(':');
+        if (colon == Glib::ustring::npos || colon == 0)
+            return false;
+        host = target.substr(0, colon);
+        try {
+            size_t end;
+            port = std::stoi(target.substr(colon + 1), &end);
+            if (end != target.size() - colon - 1)
+                return false;
+        } catch (std::exception &) {
+            return false;
+        }
+        return port > 0 && port <= 65535;
+    }
+
+    // The --forward ports and --socks proxy live on the SSH session of the
+    // VNC connection, so they're opened again whenever that session had to
+    // be replaced
+    void open_forwards()
+    {
+        if ((m_forward_targets.empty() && !m_socks) || m_ssh->has_forwards())
+            return;
+        if (!m_last_params.use_tunnel || !m_ssh->is_alive()) {
+            std::cerr << "Port forwards require an SSH tunnel" << std::endl;
+            return;
+        }
+
+        for (const auto &target : m_forward_targets) {
+            Glib::ustring host;
+            int port;
+            (void)parse_forward_target(target, host, port);
+            guint16 local_port = m_ssh->forward_port(host, port);
+            if (local_port != 0) {
+                std::cout << "Forwarding 127.0.0.1:" << local_port << " to " << target
+                          << std::endl;
+            }
+        }
+        if (m_socks) {
+            auto path = m_ssh->forward_socks();
+            if (!path.empty())
+                std::cout << "SOCKS5 proxy listening on " << path << std::endl;
+        }
+    }
+
+    bool connect_dialog()
+    {
+        if (!show_connect_dialog(*m_vnc, *m_ssh, m_last_params))
+            return false;
+        open_forwards();
+        return true;
+    }
+
+    // Reopen the last connection without going through the connect dialog
+    bool reconnect(bool interactive)
+    {
+        if (!Vnc::ConnectDialog::open_connection(*m_vnc, *m_ssh, m_last_params, interactive))
+            return false;
+        m_vnc->restore_session_state();
+        m_vnc->show_all();
+        open_forwards();
+        return true;
+    }
+
+    void schedule_reconnect()
+    {
+        if (m_reconnect_attempts >= RECONNECT_MAX_ATTEMPTS) {
+            m_reconnect_attempts = 0;
+            m_ssh->set_reconnect_pending(false);
+            m_vnc->stop_auto_reconnect();
+            if (!connect_dialog())
+                quit();
+            return;
+        }
+
+        // Add +/-25% jitter, so clients cut off by the same outage don't
+        // all retry in lockstep
+        int delay = std::min(RECONNECT_DELAY_MAX_MS,
+                             RECONNECT_DELAY_INITIAL_MS << m_reconnect_attempts);
+        delay += g_random_int_range(-delay / 4, delay / 4 + 1);
+        ++m_reconnect_attempts;
+
+        // If the SSH session survived, have a channel to the VNC server
+        // ready by the time the timer fires
+        m_ssh->set_reconnect_pending(true);
+
+        m_reconnect_timer = Glib::signal_timeout().connect([this]() {
+            // Failures after this point come back through signal_auto_reconnect
+            if (!reconnect(false))
+                schedule_reconnect();
+            return false;
+        }, delay);
+    }
 };
 
 int main(int argc, char *argv[])
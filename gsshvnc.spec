@@ -16,6 +16,7 @@ BuildRequires:	pkgconfig(gtk-vnc-2.0)
 BuildRequires:	pkgconfig(gtkmm-3.0)
 BuildRequires:	pkgconfig(libsecret-1)
 BuildRequires:	pkgconfig(libssh)
+BuildRequires:	pkgconfig(zlib)
 #Requires:	
 
 %description
@@ -0,0 +1,441 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfbcapture.h"
+#include "sshtunnel.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#define RFB_CAPTURE_MAGIC       "GSVNCRFB"
+#define RFB_CAPTURE_MAGIC_SIZE  8
+#define RFB_CAPTURE_VERSION     1
+#define RFB_RECORD_HEADER_SIZE  8
+
+// Often enough that a capture of a crashing session is still useful
+#define RFB_CAPTURE_FLUSH_INTERVAL  std::chrono::seconds(1)
+
+// Beyond this, the disk can't keep up and the capture is given up rather
+// than holding the whole session in memory
+#define RFB_CAPTURE_MAX_QUEUED      (64 * 1024 * 1024)
+
+#define RFB_VERSION_SIZE        12
+#define RFB_CHALLENGE_SIZE      16
+
+#define RFB_SECURITY_INVALID    0
+#define RFB_SECURITY_NONE       1
+#define RFB_SECURITY_VNC_AUTH   2
+
+static void put_be32(char *buffer, uint32_t value)
+{
+    buffer[0] = static_cast<char>(value >> 24);
+    buffer[1] = static_cast<char>(value >> 16);
+    buffer[2] = static_cast<char>(value >> 8);
+    buffer[3] = static_cast<char>(value);
+}
+
+static uint32_t get_be32(const char *buffer)
+{
+    auto bytes = reinterpret_cast<const unsigned char *>(buffer);
+    return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16)
+           | (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+}
+
+RfbCapture::RfbCapture()
+    : m_state(SERVER_VERSION), m_minor_version(), m_stop(false), m_write_failed(false)
+{
+}
+
+RfbCapture::~RfbCapture()
+{
+    if (m_writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_queue_lock);
+            m_stop = true;
+        }
+        m_queue_cond.notify_all();
+        m_writer.join();
+    }
+}
+
+bool RfbCapture::open(const std::string &path)
+{
+    m_file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!m_file) {
+        std::cerr << "Error creating RFB capture " << path << ": "
+                  << g_strerror(errno) << std::endl;
+        return false;
+    }
+
+    char header[RFB_CAPTURE_MAGIC_SIZE + 4];
+    memcpy(header, RFB_CAPTURE_MAGIC, RFB_CAPTURE_MAGIC_SIZE);
+    put_be32(header + RFB_CAPTURE_MAGIC_SIZE, RFB_CAPTURE_VERSION);
+    m_file.write(header, sizeof(header));
+    m_path = path;
+    m_writer = std::thread([this]() { write_queued(); });
+    return true;
+}
+
+void RfbCapture::write_queued()
+{
+    auto last_flush = std::chrono::steady_clock::now();
+    std::string records;
+    std::unique_lock<std::mutex> lock(m_queue_lock);
+    for ( ;; ) {
+        m_queue_cond.wait_for(lock, RFB_CAPTURE_FLUSH_INTERVAL,
+                              [this]() { return m_stop || !m_queue.empty(); });
+        const bool stop = m_stop;
+        records.clear();
+        records.swap(m_queue);
+        lock.unlock();
+
+        m_file.write(records.data(), records.size());
+        const auto now = std::chrono::steady_clock::now();
+        if (stop || now - last_flush >= RFB_CAPTURE_FLUSH_INTERVAL) {
+            m_file.flush();
+            last_flush = now;
+        }
+        if (!m_file) {
+            std::cerr << "Error writing RFB capture " << m_path << std::endl;
+            m_write_failed = true;
+            return;
+        }
+        if (stop)
+            return;
+        lock.lock();
+    }
+}
+
+void RfbCapture::client_data(const char *data, size_t len)
+{
+    if (m_state == RECORDING || m_state == ABANDONED)
+        return;
+    m_client_pending.append(data, len);
+    advance();
+}
+
+void RfbCapture::server_data(const char *data, size_t len)
+{
+    if (m_state == RECORDING) {
+        write_record(data, len);
+    } else if (m_state != ABANDONED) {
+        m_server_pending.append(data, len);
+        advance();
+    }
+}
+
+void RfbCapture::advance()
+{
+    for ( ;; ) {
+        switch (m_state) {
+        case SERVER_VERSION:
+            if (m_server_pending.size() < RFB_VERSION_SIZE)
+                return;
+            m_server_pending.erase(0, RFB_VERSION_SIZE);
+            m_state = CLIENT_VERSION;
+            break;
+
+        case CLIENT_VERSION:
+            // The client answers with the version both sides will use, e.g.
+            // "RFB 003.008\n".  Anything before 3.7 behaves like 3.3.
+            if (m_client_pending.size() < RFB_VERSION_SIZE)
+                return;
+            m_minor_version = std::atoi(m_client_pending.substr(8, 3).c_str());
+            m_client_pending.erase(0, RFB_VERSION_SIZE);
+            m_state = (m_minor_version >= 7) ? SECURITY_TYPES : SECURITY_TYPE_33;
+            break;
+
+        case SECURITY_TYPE_33:
+            // RFB 3.3 servers pick the security type themselves
+            if (m_server_pending.size() < 4)
+                return;
+            select_security(get_be32(m_server_pending.data()));
+            m_server_pending.erase(0, 4);
+            break;
+
+        case SECURITY_TYPES:
+            {
+                if (m_server_pending.empty())
+                    return;
+                size_t count = static_cast<unsigned char>(m_server_pending[0]);
+                if (count == 0) {
+                    abandon("the server refused the connection");
+                    return;
+                }
+                if (m_server_pending.size() < 1 + count)
+                    return;
+                m_server_pending.erase(0, 1 + count);
+                m_state = SECURITY_CHOICE;
+            }
+            break;
+
+        case SECURITY_CHOICE:
+            if (m_client_pending.empty())
+                return;
+            select_security(static_cast<unsigned char>(m_client_pending[0]));
+            m_client_pending.erase(0, 1);
+            break;
+
+        case VNC_AUTH:
+            if (m_server_pending.size() < RFB_CHALLENGE_SIZE
+                    || m_client_pending.size() < RFB_CHALLENGE_SIZE)
+                return;
+            m_server_pending.erase(0, RFB_CHALLENGE_SIZE);
+            m_client_pending.erase(0, RFB_CHALLENGE_SIZE);
+            m_state = SECURITY_RESULT;
+            break;
+
+        case SECURITY_RESULT:
+            if (m_server_pending.size() < 4)
+                return;
+            if (get_be32(m_server_pending.data()) != 0) {
+                abandon("authentication failed");
+                return;
+            }
+            m_server_pending.erase(0, 4);
+            m_state = CLIENT_INIT;
+            break;
+
+        case CLIENT_INIT:
+            {
+                // Everything from the ServerInit message on is recorded
+                if (m_client_pending.empty())
+                    return;
+                m_client_pending.clear();
+                m_state = RECORDING;
+                m_last_record = std::chrono::steady_clock::now();
+                std::string server_init;
+                server_init.swap(m_server_pending);
+                if (!server_init.empty())
+                    write_record(server_init.data(), server_init.size());
+            }
+            return;
+
+        case RECORDING:
+        case ABANDONED:
+            return;
+        }
+    }
+}
+
+void RfbCapture::select_security(uint32_t type)
+{
+    switch (type) {
+    case RFB_SECURITY_INVALID:
+        abandon("the server refused the connection");
+        break;
+    case RFB_SECURITY_NONE:
+        // Only RFB 3.8 sends a result when there's no authentication
+        m_state = (m_minor_version >= 8) ? SECURITY_RESULT : CLIENT_INIT;
+        break;
+    case RFB_SECURITY_VNC_AUTH:
+        m_state = VNC_AUTH;
+        break;
+    default:
+        abandon("only unencrypted sessions can be replayed");
+        break;
+    }
+}
+
+void RfbCapture::abandon(const char *reason)
+{
+    std::cerr << "Not recording RFB capture " << m_path << ": " << reason << std::endl;
+    m_state = ABANDONED;
+    m_server_pending.clear();
+    m_client_pending.clear();
+}
+
+void RfbCapture::write_record(const char *data, size_t len)
+{
+    const auto now = std::chrono::steady_clock::now();
+    auto delay = std::chrono::duration_cast<std::chrono::microseconds>(now - m_last_record).count();
+    m_last_record = now;
+
+    if (m_write_failed) {
+        m_state = ABANDONED;
+        return;
+    }
+
+    char header[RFB_RECORD_HEADER_SIZE];
+    put_be32(header, static_cast<uint32_t>(std::min<int64_t>(delay, UINT32_MAX)));
+    put_be32(header + 4, static_cast<uint32_t>(len));
+    bool overflow = false;
+    {
+        std::lock_guard<std::mutex> lock(m_queue_lock);
+        if (m_queue.size() + len > RFB_CAPTURE_MAX_QUEUED) {
+            // Stops the writer after what's already in the file
+            m_queue.clear();
+            m_stop = true;
+            overflow = true;
+        } else {
+            m_queue.append(header, sizeof(header));
+            m_queue.append(data, len);
+        }
+    }
+    m_queue_cond.notify_one();
+    if (overflow)
+        abandon("writing the capture fell too far behind");
+}
+
+RfbReplay::RfbReplay()
+    : m_realtime(true), m_stop(false)
+{
+}
+
+RfbReplay::~RfbReplay()
+{
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stop = true;
+        }
+        m_stop_cond.notify_all();
+
+        // Wakes up the replay thread if it's blocked on the socket
+        try {
+            m_socket->shutdown(true, true);
+        } catch (Gio::Error &) {
+            // Already closed by the client
+        }
+        m_thread.join();
+    }
+}
+
+int RfbReplay::start(const std::string &path, bool realtime)
+{
+    m_file.open(path, std::ios::in | std::ios::binary);
+    char header[RFB_CAPTURE_MAGIC_SIZE + 4];
+    if (!m_file.read(header, sizeof(header))) {
+        std::cerr << "Error reading RFB capture " << path << std::endl;
+        return -1;
+    }
+    if (memcmp(header, RFB_CAPTURE_MAGIC, RFB_CAPTURE_MAGIC_SIZE) != 0
+            || get_be32(header + RFB_CAPTURE_MAGIC_SIZE) != RFB_CAPTURE_VERSION) {
+        std::cerr << path << " is not a supported RFB capture" << std::endl;
+        return -1;
+    }
+
+    if (!SshTunnel::create_socket_pair(m_client_end, m_socket))
+        return -1;
+    m_realtime = realtime;
+    m_thread = std::thread([this]() { play(); });
+    return m_client_end->get_fd();
+}
+
+bool RfbReplay::send_all(const char *data, size_t len)
+{
+    while (len > 0) {
+        gssize sent = m_socket->send(data, len);
+        if (sent <= 0)
+            return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+bool RfbReplay::receive_all(char *data, size_t len)
+{
+    while (len > 0) {
+        gssize received = m_socket->receive(data, len);
+        if (received <= 0)
+            return false;
+        data += received;
+        len -= received;
+    }
+    return true;
+}
+
+bool RfbReplay::drain_client()
+{
+    // Framebuffer update requests and input are ignored, but they have to
+    // be read so the client never blocks on a full socket
+    char buffer[4096];
+    while (m_socket->condition_check(Glib::IO_IN) & Glib::IO_IN) {
+        if (m_socket->receive(buffer, sizeof(buffer)) <= 0)
+            return false;
+    }
+    return true;
+}
+
+void RfbReplay::play()
+{
+    uint64_t total_bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    try {
+        // Stand in for the server's handshake, offering no authentication
+        char buffer[RFB_VERSION_SIZE];
+        const char security_types[] = { 1, RFB_SECURITY_NONE };
+        const char security_result[] = { 0, 0, 0, 0 };
+        if (!send_all("RFB 003.008\n", RFB_VERSION_SIZE)
+                || !receive_all(buffer, RFB_VERSION_SIZE)
+                || !send_all(security_types, sizeof(security_types))
+                || !receive_all(buffer, 1)
+                || !send_all(security_result, sizeof(security_result))
+                || !receive_all(buffer, 1)) {
+            if (!m_stop)
+                std::cerr << "RFB replay: the client disconnected during the handshake" << std::endl;
+            return;
+        }
+
+        start = std::chrono::steady_clock::now();
+        auto due = start;
+        std::vector<char> chunk;
+        char header[RFB_RECORD_HEADER_SIZE];
+        while (!m_stop && m_file.read(header, sizeof(header))) {
+            chunk.resize(get_be32(header + 4));
+            if (!m_file.read(chunk.data(), chunk.size())) {
+                std::cerr << "RFB replay: the capture is truncated" << std::endl;
+                break;
+            }
+
+            if (m_realtime) {
+                due += std::chrono::microseconds(get_be32(header));
+                std::unique_lock<std::mutex> lock(m_lock);
+                if (m_stop_cond.wait_until(lock, due, [this]() { return bool(m_stop); }))
+                    return;
+            }
+            if (!drain_client() || !send_all(chunk.data(), chunk.size()))
+                return;
+            total_bytes += chunk.size();
+        }
+    } catch (Gio::Error &err) {
+        if (!m_stop)
+            std::cerr << "RFB replay: " << err.what() << std::endl;
+        return;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Replayed " << total_bytes << " bytes in " << elapsed.count() << " s ("
+              << (total_bytes / elapsed.count() / (1024 * 1024)) << " MiB/s)" << std::endl;
+
+    // Keep the connection (and the last frame) open until the client or
+    // the destructor closes it
+    try {
+        while (!m_stop && drain_client()) {
+            std::unique_lock<std::mutex> lock(m_lock);
+            if (m_stop_cond.wait_for(lock, std::chrono::milliseconds(100),
+                                     [this]() { return bool(m_stop); }))
+                break;
+        }
+    } catch (Gio::Error &) {
+        // The client went away
+    }
+}
@@ -0,0 +1,135 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RFBCAPTURE_H
+#define _RFBCAPTURE_H
+
+#include <giomm/socket.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/* Capture files start with the 8 byte magic "GSVNCRFB" and a big-endian
+ * 32-bit format version.  Each chunk the VNC client received follows as a
+ * record of two big-endian 32-bit values, the microseconds since the
+ * previous record and the chunk length, and then the chunk itself.
+ *
+ * The RFB handshake isn't recorded, since it depends on the client's
+ * answers and would include the VNC authentication challenge.  Instead,
+ * the recording starts at the ServerInit message, and RfbReplay stands in
+ * for the handshake without authentication.  Encrypted sessions (VeNCrypt,
+ * TLS) can't be replayed, so they aren't recorded.
+ */
+
+// Records the server side of an RFB connection.  Only fed from the SSH
+// forward thread; the file is written by a thread of its own, so a slow
+// disk never holds up the tunnel.
+class RfbCapture
+{
+public:
+    RfbCapture();
+    ~RfbCapture();
+
+    RfbCapture(const RfbCapture &) = delete;
+    RfbCapture &operator=(const RfbCapture &) = delete;
+
+    bool open(const std::string &path);
+
+    // Data the VNC client sent, which is only needed to follow the handshake
+    void client_data(const char *data, size_t len);
+
+    // Data the VNC client received
+    void server_data(const char *data, size_t len);
+
+private:
+    enum State
+    {
+        SERVER_VERSION,
+        CLIENT_VERSION,
+        SECURITY_TYPE_33,
+        SECURITY_TYPES,
+        SECURITY_CHOICE,
+        VNC_AUTH,
+        SECURITY_RESULT,
+        CLIENT_INIT,
+        RECORDING,
+        ABANDONED,
+    };
+
+    std::ofstream m_file;
+    std::string m_path;
+    State m_state;
+    int m_minor_version;
+
+    // Handshake bytes which haven't been parsed yet
+    std::string m_server_pending;
+    std::string m_client_pending;
+
+    std::chrono::steady_clock::time_point m_last_record;
+
+    // Records waiting for the writer thread
+    std::thread m_writer;
+    std::mutex m_queue_lock;
+    std::condition_variable m_queue_cond;
+    std::string m_queue;
+    bool m_stop;
+    std::atomic_bool m_write_failed;
+
+    void write_queued();
+    void advance();
+    void select_security(uint32_t type);
+    void abandon(const char *reason);
+    void write_record(const char *data, size_t len);
+};
+
+// Plays a capture back to a VNC client, either with the original timing or
+// as fast as the client will read it
+class RfbReplay
+{
+public:
+    RfbReplay();
+    ~RfbReplay();
+
+    RfbReplay(const RfbReplay &) = delete;
+    RfbReplay &operator=(const RfbReplay &) = delete;
+
+    // Returns an fd for DisplayWindow::open_fd(), or -1 on error.  The fd
+    // remains owned by the RfbReplay.
+    int start(const std::string &path, bool realtime);
+
+private:
+    std::ifstream m_file;
+    bool m_realtime;
+    Glib::RefPtr<Gio::Socket> m_client_end;
+    Glib::RefPtr<Gio::Socket> m_socket;
+    std::thread m_thread;
+
+    std::mutex m_lock;
+    std::condition_variable m_stop_cond;
+    std::atomic_bool m_stop;
+
+    void play();
+    bool send_all(const char *data, size_t len);
+    bool receive_all(char *data, size_t len);
+    bool drain_client();
+};
+
+#endif
@@ -0,0 +1,148 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ringbuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Don't hang on to more than this many idle blocks of any one size
+#define POOL_MAX_FREE_BLOCKS 8
+
+BufferPool::~BufferPool()
+{
+    for (const auto &size_class : m_free_blocks) {
+        for (char *block : size_class.second)
+            delete[] block;
+    }
+}
+
+char *BufferPool::acquire(size_t size)
+{
+    auto &free_list = m_free_blocks[size];
+    if (free_list.empty())
+        return new char[size];
+
+    char *block = free_list.back();
+    free_list.pop_back();
+    return block;
+}
+
+void BufferPool::release(char *block, size_t size)
+{
+    if (!block)
+        return;
+
+    auto &free_list = m_free_blocks[size];
+    if (free_list.size() < POOL_MAX_FREE_BLOCKS)
+        free_list.push_back(block);
+    else
+        delete[] block;
+}
+
+RingBuffer::RingBuffer(BufferPool &pool, size_t initial_size, size_t max_size)
+    : m_pool(pool), m_data(), m_capacity(), m_initial_size(initial_size),
+      m_max_size(max_size), m_head(), m_size()
+{ }
+
+RingBuffer::~RingBuffer()
+{
+    m_pool.release(m_data, m_capacity);
+}
+
+char *RingBuffer::write_ptr(size_t &len)
+{
+    if (!m_data)
+        reserve(m_initial_size);
+    else if (m_size == m_capacity && m_capacity < m_max_size)
+        reserve(m_capacity * 2);
+
+    size_t tail = (m_head + m_size) & (m_capacity - 1);
+    if (m_size == m_capacity)
+        len = 0;
+    else if (tail >= m_head)
+        len = m_capacity - tail;
+    else
+        len = m_head - tail;
+    return m_data + tail;
+}
+
+void RingBuffer::commit(size_t len)
+{
+    m_size += len;
+}
+
+size_t RingBuffer::write(const void *data, size_t len)
+{
+    auto src = reinterpret_cast<const char *>(data);
+    size_t written = 0;
+    while (written < len) {
+        size_t avail;
+        char *dest = write_ptr(avail);
+        if (avail == 0)
+            break;
+        avail = std::min(avail, len - written);
+        std::memcpy(dest, src + written, avail);
+        commit(avail);
+        written += avail;
+    }
+    return written;
+}
+
+const char *RingBuffer::read_ptr(size_t &len) const
+{
+    len = std::min(m_size, m_capacity - m_head);
+    return m_data + m_head;
+}
+
+void RingBuffer::consume(size_t len)
+{
+    m_size -= len;
+    if (m_size == 0) {
+        // Keep the free space contiguous while we're idle
+        m_head = 0;
+    } else {
+        m_head = (m_head + len) & (m_capacity - 1);
+    }
+}
+
+size_t RingBuffer::peek(void *dest, size_t len) const
+{
+    auto out = reinterpret_cast<char *>(dest);
+    len = std::min(len, m_size);
+    if (len == 0)
+        return 0;
+
+    size_t first = std::min(len, m_capacity - m_head);
+    std::memcpy(out, m_data + m_head, first);
+    std::memcpy(out + first, m_data, len - first);
+    return len;
+}
+
+void RingBuffer::reserve(size_t capacity)
+{
+    char *data = m_pool.acquire(capacity);
+    if (m_size) {
+        size_t first = std::min(m_size, m_capacity - m_head);
+        std::memcpy(data, m_data + m_head, first);
+        std::memcpy(data + first, m_data, m_size - first);
+    }
+    m_pool.release(m_data, m_capacity);
+
+    m_data = data;
+    m_capacity = capacity;
+    m_head = 0;
+}
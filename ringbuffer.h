@@ -0,0 +1,90 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RINGBUFFER_H
+#define _RINGBUFFER_H
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+/* Recycles buffer storage between clients.  Not thread safe -- each
+ * forwarding thread owns its own pool. */
+class BufferPool
+{
+public:
+    BufferPool() = default;
+    ~BufferPool();
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    char *acquire(size_t size);
+    void release(char *block, size_t size);
+
+private:
+    std::unordered_map<size_t, std::vector<char *>> m_free_blocks;
+};
+
+/* A byte FIFO which starts out small and doubles its storage (up to
+ * max_size) whenever it fills up.  Sizes must be powers of two. */
+class RingBuffer
+{
+public:
+    RingBuffer(BufferPool &pool, size_t initial_size, size_t max_size);
+    ~RingBuffer();
+
+    RingBuffer(const RingBuffer &) = delete;
+    RingBuffer &operator=(const RingBuffer &) = delete;
+
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    bool empty() const { return m_size == 0; }
+    bool full() const { return m_size == m_max_size; }
+    size_t space() const { return m_max_size - m_size; }
+
+    // Returns the largest contiguous free region, growing the storage if
+    // necessary.  len is 0 if the buffer is full.  Call commit() with the
+    // number of bytes actually stored.
+    char *write_ptr(size_t &len);
+    void commit(size_t len);
+
+    // Copies as much of data as will fit, and returns the number of bytes
+    // that were stored.
+    size_t write(const void *data, size_t len);
+
+    // Returns the largest contiguous region of queued data.  Call consume()
+    // with the number of bytes actually used.
+    const char *read_ptr(size_t &len) const;
+    void consume(size_t len);
+
+    // Copies up to len bytes from the front of the buffer without consuming
+    // them, and returns the number of bytes copied.
+    size_t peek(void *dest, size_t len) const;
+
+private:
+    BufferPool &m_pool;
+    char *m_data;
+    size_t m_capacity;
+    size_t m_initial_size;
+    size_t m_max_size;
+    size_t m_head;
+    size_t m_size;
+
+    void reserve(size_t capacity);
+};
+
+#endif
@@ -0,0 +1,148 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sessionplayer.h"
+
+#include <gdkmm/general.h>
+#include <glibmm/main.h>
+#include <glibmm/miscutils.h>
+#include <gtkmm/box.h>
+#include <gtkmm/drawingarea.h>
+#include <gtkmm/label.h>
+#include <gtkmm/scale.h>
+#include <gtkmm/togglebutton.h>
+#include <algorithm>
+#include <cstdio>
+
+#define PLAYER_TICK_MS  40
+
+static Glib::ustring format_time(uint32_t time_ms)
+{
+    const unsigned seconds = time_ms / 1000;
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%u:%02u:%02u", seconds / 3600, (seconds / 60) % 60,
+             seconds % 60);
+    return buffer;
+}
+
+SessionPlayer::SessionPlayer()
+    : m_position(), m_updating_slider(false)
+{
+    set_title("gsshvnc Session Playback");
+    set_default_size(1024, 768);
+
+    auto layout = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_VERTICAL, 0));
+    m_canvas = Gtk::manage(new Gtk::DrawingArea);
+    m_canvas->signal_draw().connect(sigc::mem_fun(this, &SessionPlayer::draw_frame));
+    layout->pack_start(*m_canvas, true, true, 0);
+
+    auto controls = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL, 6));
+    controls->set_border_width(6);
+    m_play = Gtk::manage(new Gtk::ToggleButton("_Play", true));
+    m_play->signal_toggled().connect([this]() { set_playing(m_play->get_active()); });
+    controls->pack_start(*m_play, false, false, 0);
+    m_slider = Gtk::manage(new Gtk::Scale(Gtk::ORIENTATION_HORIZONTAL));
+    m_slider->set_draw_value(false);
+    m_slider->signal_value_changed().connect([this]() {
+        if (!m_updating_slider)
+            seek(static_cast<uint32_t>(m_slider->get_value()));
+    });
+    controls->pack_start(*m_slider, true, true, 0);
+    m_time = Gtk::manage(new Gtk::Label);
+    controls->pack_start(*m_time, false, false, 0);
+    layout->pack_start(*controls, false, false, 0);
+
+    add(*layout);
+}
+
+bool SessionPlayer::open(const std::string &path)
+{
+    if (!m_playback.open(path))
+        return false;
+
+    set_title(Glib::ustring::compose("%1 - gsshvnc Session Playback",
+                                     Glib::path_get_basename(path)));
+    m_slider->set_range(0, std::max<uint32_t>(m_playback.duration_ms(), 1));
+    m_slider->set_increments(1000, 10000);
+    seek(0);
+    return true;
+}
+
+void SessionPlayer::seek(uint32_t time_ms)
+{
+    m_position = std::min(time_ms, m_playback.duration_ms());
+
+    // Keep showing the last frame if this one can't be decoded
+    auto frame = m_playback.frame_at(m_position);
+    if (frame)
+        m_frame = frame;
+
+    m_updating_slider = true;
+    m_slider->set_value(m_position);
+    m_updating_slider = false;
+    m_time->set_text(Glib::ustring::compose("%1 / %2", format_time(m_position),
+                                            format_time(m_playback.duration_ms())));
+    m_canvas->queue_draw();
+}
+
+void SessionPlayer::set_playing(bool playing)
+{
+    m_play_timer.disconnect();
+    if (!playing)
+        return;
+
+    if (m_position >= m_playback.duration_ms())
+        seek(0);
+    m_play_clock = std::chrono::steady_clock::now();
+    m_play_timer = Glib::signal_timeout().connect(sigc::mem_fun(this, &SessionPlayer::play_tick),
+                                                  PLAYER_TICK_MS);
+}
+
+bool SessionPlayer::play_tick()
+{
+    // Only whole milliseconds are taken off the clock, so playback doesn't
+    // drift from rounding
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - m_play_clock);
+    m_play_clock += elapsed;
+    seek(m_position + static_cast<uint32_t>(elapsed.count()));
+
+    if (m_position >= m_playback.duration_ms()) {
+        m_play->set_active(false);
+        return false;
+    }
+    return true;
+}
+
+bool SessionPlayer::draw_frame(const Cairo::RefPtr<Cairo::Context> &cr)
+{
+    cr->set_source_rgb(0, 0, 0);
+    cr->paint();
+    if (!m_frame)
+        return true;
+
+    // Fit the frame to the window, keeping its aspect ratio
+    const double width = m_canvas->get_allocated_width();
+    const double height = m_canvas->get_allocated_height();
+    const double scale = std::min(width / m_frame->get_width(),
+                                  height / m_frame->get_height());
+    cr->translate((width - m_frame->get_width() * scale) / 2,
+                  (height - m_frame->get_height() * scale) / 2);
+    cr->scale(scale, scale);
+    Gdk::Cairo::set_source_pixbuf(cr, m_frame, 0, 0);
+    cr->paint();
+    return true;
+}
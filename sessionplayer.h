@@ -0,0 +1,63 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SESSIONPLAYER_H
+#define _SESSIONPLAYER_H
+
+#include "sessionrecording.h"
+
+#include <gtkmm/applicationwindow.h>
+#include <chrono>
+
+namespace Gtk
+{
+
+class DrawingArea;
+class Label;
+class Scale;
+class ToggleButton;
+
+}
+
+// Reviews a session recording, with a slider to jump to any point
+class SessionPlayer : public Gtk::ApplicationWindow
+{
+public:
+    SessionPlayer();
+
+    bool open(const std::string &path);
+
+private:
+    SessionPlayback m_playback;
+    Glib::RefPtr<Gdk::Pixbuf> m_frame;
+    uint32_t m_position;
+
+    Gtk::DrawingArea *m_canvas;
+    Gtk::ToggleButton *m_play;
+    Gtk::Scale *m_slider;
+    Gtk::Label *m_time;
+    bool m_updating_slider;
+
+    sigc::connection m_play_timer;
+    std::chrono::steady_clock::time_point m_play_clock;
+
+    void seek(uint32_t time_ms);
+    void set_playing(bool playing);
+    bool play_tick();
+    bool draw_frame(const Cairo::RefPtr<Cairo::Context> &cr);
+};
+
+#endif
@@ -0,0 +1,481 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sessionrecording.h"
+
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#define SESSION_MAGIC           "GSVNCSES"
+#define SESSION_INDEX_MAGIC     "GSVNCIDX"
+#define SESSION_END_MAGIC       "GSVNCEND"
+#define SESSION_MAGIC_SIZE      8
+#define SESSION_VERSION         1
+#define SESSION_HEADER_SIZE     (SESSION_MAGIC_SIZE + 4)
+#define SESSION_TRAILER_SIZE    (8 + SESSION_MAGIC_SIZE)
+#define SESSION_FRAME_HEADER    20
+#define SESSION_INDEX_ENTRY     12
+#define SESSION_RECT_HEADER     8
+
+#define FRAME_KEYFRAME          1
+#define FRAME_DELTA             2
+
+// Seeking decodes one keyframe and at most this much of delta frames
+#define SESSION_KEYFRAME_INTERVAL_MS    10000
+
+// Past this many rectangles, a delta frame just covers their bounding box
+#define SESSION_MAX_RECTS       64
+
+static void put_be16(std::vector<unsigned char> &buffer, uint32_t value)
+{
+    buffer.push_back(static_cast<unsigned char>(value >> 8));
+    buffer.push_back(static_cast<unsigned char>(value));
+}
+
+static void put_be32(std::vector<unsigned char> &buffer, uint32_t value)
+{
+    put_be16(buffer, value >> 16);
+    put_be16(buffer, value);
+}
+
+static void put_be64(std::vector<unsigned char> &buffer, uint64_t value)
+{
+    put_be32(buffer, static_cast<uint32_t>(value >> 32));
+    put_be32(buffer, static_cast<uint32_t>(value));
+}
+
+static uint32_t get_be16(const unsigned char *buffer)
+{
+    return (uint32_t(buffer[0]) << 8) | uint32_t(buffer[1]);
+}
+
+static uint32_t get_be32(const unsigned char *buffer)
+{
+    return (get_be16(buffer) << 16) | get_be16(buffer + 2);
+}
+
+static uint64_t get_be64(const unsigned char *buffer)
+{
+    return (uint64_t(get_be32(buffer)) << 32) | get_be32(buffer + 4);
+}
+
+// Append a rectangle of the pixbuf as packed 24-bit RGB
+static void append_pixels(std::vector<unsigned char> &buffer,
+                          const Glib::RefPtr<Gdk::Pixbuf> &pixbuf,
+                          int x, int y, int width, int height)
+{
+    const int channels = pixbuf->get_n_channels();
+    const int rowstride = pixbuf->get_rowstride();
+    const guint8 *pixels = pixbuf->get_pixels();
+    for (int row = y; row < y + height; ++row) {
+        const guint8 *src = pixels + row * rowstride + x * channels;
+        if (channels == 3) {
+            buffer.insert(buffer.end(), src, src + width * 3);
+        } else {
+            for (int col = 0; col < width; ++col, src += channels)
+                buffer.insert(buffer.end(), src, src + 3);
+        }
+    }
+}
+
+SessionRecorder::SessionRecorder()
+    : m_queued_time(), m_stop(false), m_write_failed(false), m_last_time(),
+      m_last_keyframe(), m_width(), m_height()
+{
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    close();
+}
+
+bool SessionRecorder::open(const std::string &path)
+{
+    m_file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!m_file) {
+        std::cerr << "Error creating session recording " << path << ": "
+                  << g_strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::vector<unsigned char> header(SESSION_MAGIC, SESSION_MAGIC + SESSION_MAGIC_SIZE);
+    put_be32(header, SESSION_VERSION);
+    m_file.write(reinterpret_cast<const char *>(header.data()), header.size());
+    m_path = path;
+    m_start = std::chrono::steady_clock::now();
+    m_writer = std::thread([this]() { write_queued(); });
+    return true;
+}
+
+void SessionRecorder::close()
+{
+    // The writer finishes the frame it was given before it stops
+    if (m_writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_queue_lock);
+            m_stop = true;
+        }
+        m_queue_cond.notify_all();
+        m_writer.join();
+    }
+    if (!m_file.is_open())
+        return;
+
+    const uint64_t index_offset = m_file.tellp();
+    std::vector<unsigned char> index(SESSION_INDEX_MAGIC, SESSION_INDEX_MAGIC + SESSION_MAGIC_SIZE);
+    put_be32(index, m_last_time);
+    put_be32(index, static_cast<uint32_t>(m_index.size()));
+    for (const auto &entry : m_index) {
+        put_be32(index, entry.time_ms);
+        put_be64(index, entry.offset);
+    }
+    put_be64(index, index_offset);
+    index.insert(index.end(), SESSION_END_MAGIC, SESSION_END_MAGIC + SESSION_MAGIC_SIZE);
+    m_file.write(reinterpret_cast<const char *>(index.data()), index.size());
+
+    m_file.close();
+    if (m_file.fail())
+        std::cerr << "Error writing session recording " << m_path << std::endl;
+}
+
+void SessionRecorder::add_rect(std::vector<Rect> &rects, const Rect &rect)
+{
+    if (rects.size() < SESSION_MAX_RECTS) {
+        rects.push_back(rect);
+        return;
+    }
+
+    // Too fragmented to be worth tracking separately
+    Rect bounds = rects[0];
+    rects.push_back(rect);
+    for (const auto &other : rects) {
+        const int right = std::max(bounds.x + bounds.width, other.x + other.width);
+        const int bottom = std::max(bounds.y + bounds.height, other.y + other.height);
+        bounds.x = std::min(bounds.x, other.x);
+        bounds.y = std::min(bounds.y, other.y);
+        bounds.width = right - bounds.x;
+        bounds.height = bottom - bounds.y;
+    }
+    rects.assign(1, bounds);
+}
+
+void SessionRecorder::add_damage(int x, int y, int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return;
+    add_rect(m_damage, { x, y, width, height });
+}
+
+void SessionRecorder::add_frame(const Glib::RefPtr<Gdk::Pixbuf> &framebuffer)
+{
+    if (!m_writer.joinable() || m_write_failed || !framebuffer)
+        return;
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - m_start);
+    {
+        std::lock_guard<std::mutex> lock(m_queue_lock);
+        if (!m_queued_frame)
+            m_queued_damage.clear();
+        for (const auto &rect : m_damage)
+            add_rect(m_queued_damage, rect);
+        m_queued_frame = framebuffer;
+        m_queued_time = static_cast<uint32_t>(elapsed.count());
+    }
+    m_queue_cond.notify_one();
+    m_damage.clear();
+}
+
+void SessionRecorder::write_queued()
+{
+    Glib::RefPtr<Gdk::Pixbuf> framebuffer;
+    std::vector<Rect> damage;
+    uint32_t time_ms;
+    std::unique_lock<std::mutex> lock(m_queue_lock);
+    for ( ;; ) {
+        m_queue_cond.wait(lock, [this]() { return m_stop || m_queued_frame; });
+        if (!m_queued_frame)
+            return;
+        framebuffer.swap(m_queued_frame);
+        damage.swap(m_queued_damage);
+        time_ms = m_queued_time;
+        lock.unlock();
+
+        encode_frame(framebuffer, damage, time_ms);
+        framebuffer.reset();
+        if (m_write_failed)
+            return;
+        lock.lock();
+    }
+}
+
+void SessionRecorder::encode_frame(const Glib::RefPtr<Gdk::Pixbuf> &framebuffer,
+                                   const std::vector<Rect> &damage, uint32_t time_ms)
+{
+    const int width = framebuffer->get_width();
+    const int height = framebuffer->get_height();
+
+    m_raw.clear();
+    if (m_index.empty() || width != m_width || height != m_height
+            || time_ms - m_last_keyframe >= SESSION_KEYFRAME_INTERVAL_MS) {
+        m_width = width;
+        m_height = height;
+        m_last_keyframe = time_ms;
+        m_raw.reserve(width * height * 3);
+        append_pixels(m_raw, framebuffer, 0, 0, width, height);
+        if (!write_frame(time_ms, FRAME_KEYFRAME))
+            m_write_failed = true;
+    } else {
+        for (const auto &rect : damage) {
+            const int x = std::max(rect.x, 0);
+            const int y = std::max(rect.y, 0);
+            const int right = std::min(rect.x + rect.width, width);
+            const int bottom = std::min(rect.y + rect.height, height);
+            if (right <= x || bottom <= y)
+                continue;
+            put_be16(m_raw, x);
+            put_be16(m_raw, y);
+            put_be16(m_raw, right - x);
+            put_be16(m_raw, bottom - y);
+            append_pixels(m_raw, framebuffer, x, y, right - x, bottom - y);
+        }
+        if (!m_raw.empty() && !write_frame(time_ms, FRAME_DELTA))
+            m_write_failed = true;
+    }
+}
+
+bool SessionRecorder::write_frame(uint32_t time_ms, uint32_t type)
+{
+    uLongf compressed_size = compressBound(m_raw.size());
+    std::vector<unsigned char> frame(SESSION_FRAME_HEADER + compressed_size);
+    if (compress2(frame.data() + SESSION_FRAME_HEADER, &compressed_size,
+                  m_raw.data(), m_raw.size(), Z_BEST_SPEED) != Z_OK) {
+        // Later delta frames would refer to this one, so stop recording
+        std::cerr << "Error compressing session recording frame" << std::endl;
+        return false;
+    }
+    frame.resize(SESSION_FRAME_HEADER + compressed_size);
+
+    std::vector<unsigned char> header;
+    put_be32(header, time_ms);
+    put_be32(header, type);
+    put_be16(header, m_width);
+    put_be16(header, m_height);
+    put_be32(header, static_cast<uint32_t>(m_raw.size()));
+    put_be32(header, static_cast<uint32_t>(compressed_size));
+    std::copy(header.begin(), header.end(), frame.begin());
+
+    if (type == FRAME_KEYFRAME)
+        m_index.push_back({ time_ms, static_cast<uint64_t>(m_file.tellp()) });
+    m_file.write(reinterpret_cast<const char *>(frame.data()), frame.size());
+    m_last_time = time_ms;
+
+    if (!m_file) {
+        std::cerr << "Error writing session recording " << m_path << std::endl;
+        m_file.close();
+        return false;
+    }
+    return true;
+}
+
+SessionPlayback::SessionPlayback()
+    : m_mapping(), m_data(), m_frames_end(), m_duration(), m_width(), m_height(),
+      m_next_frame(), m_time(), m_have_frame(false)
+{
+}
+
+SessionPlayback::~SessionPlayback()
+{
+    if (m_mapping)
+        g_mapped_file_unref(m_mapping);
+}
+
+bool SessionPlayback::open(const std::string &path)
+{
+    GError *error = nullptr;
+    m_mapping = g_mapped_file_new(path.c_str(), FALSE, &error);
+    if (!m_mapping) {
+        std::cerr << "Error opening session recording: " << error->message << std::endl;
+        g_error_free(error);
+        return false;
+    }
+
+    m_data = reinterpret_cast<const unsigned char *>(g_mapped_file_get_contents(m_mapping));
+    m_frames_end = g_mapped_file_get_length(m_mapping);
+    if (m_frames_end < SESSION_HEADER_SIZE
+            || memcmp(m_data, SESSION_MAGIC, SESSION_MAGIC_SIZE) != 0
+            || get_be32(m_data + SESSION_MAGIC_SIZE) != SESSION_VERSION) {
+        std::cerr << path << " is not a supported session recording" << std::endl;
+        return false;
+    }
+
+    if (!read_index()) {
+        std::cerr << "Session recording " << path << " has no index, rebuilding it" << std::endl;
+        scan_frames();
+    }
+    return true;
+}
+
+bool SessionPlayback::read_index()
+{
+    const size_t size = m_frames_end;
+    if (size < SESSION_HEADER_SIZE + SESSION_TRAILER_SIZE)
+        return false;
+    const unsigned char *trailer = m_data + size - SESSION_TRAILER_SIZE;
+    if (memcmp(trailer + 8, SESSION_END_MAGIC, SESSION_MAGIC_SIZE) != 0)
+        return false;
+
+    const uint64_t index_offset = get_be64(trailer);
+    const size_t index_header = SESSION_MAGIC_SIZE + 8;
+    if (index_offset < SESSION_HEADER_SIZE
+            || index_offset + index_header > size - SESSION_TRAILER_SIZE)
+        return false;
+    const unsigned char *index = m_data + index_offset;
+    if (memcmp(index, SESSION_INDEX_MAGIC, SESSION_MAGIC_SIZE) != 0)
+        return false;
+    const uint32_t count = get_be32(index + SESSION_MAGIC_SIZE + 4);
+    if (index_offset + index_header + uint64_t(count) * SESSION_INDEX_ENTRY
+            > size - SESSION_TRAILER_SIZE)
+        return false;
+
+    m_duration = get_be32(index + SESSION_MAGIC_SIZE);
+    m_frames_end = index_offset;
+    m_keyframes.resize(count);
+    const unsigned char *entry = index + index_header;
+    for (auto &keyframe : m_keyframes) {
+        keyframe.time_ms = get_be32(entry);
+        keyframe.offset = get_be64(entry + 4);
+        entry += SESSION_INDEX_ENTRY;
+    }
+    return true;
+}
+
+void SessionPlayback::scan_frames()
+{
+    // Only the headers are read, so this is quick even for long sessions
+    size_t offset = SESSION_HEADER_SIZE;
+    FrameHeader header;
+    while (read_header(offset, header)) {
+        if (header.type == FRAME_KEYFRAME)
+            m_keyframes.push_back({ header.time_ms, offset });
+        m_duration = header.time_ms;
+        offset += SESSION_FRAME_HEADER + header.compressed_size;
+    }
+
+    // Drop a frame that was only partly written
+    m_frames_end = offset;
+}
+
+bool SessionPlayback::read_header(size_t offset, FrameHeader &header) const
+{
+    if (offset + SESSION_FRAME_HEADER > m_frames_end)
+        return false;
+    const unsigned char *data = m_data + offset;
+    header.time_ms = get_be32(data);
+    header.type = get_be32(data + 4);
+    header.width = get_be16(data + 8);
+    header.height = get_be16(data + 10);
+    header.raw_size = get_be32(data + 12);
+    header.compressed_size = get_be32(data + 16);
+    return offset + SESSION_FRAME_HEADER + header.compressed_size <= m_frames_end;
+}
+
+bool SessionPlayback::apply_frame(size_t offset, const FrameHeader &header)
+{
+    m_next_frame = offset + SESSION_FRAME_HEADER + header.compressed_size;
+    m_time = header.time_ms;
+
+    m_raw.resize(header.raw_size);
+    uLongf raw_size = header.raw_size;
+    if (uncompress(m_raw.data(), &raw_size, m_data + offset + SESSION_FRAME_HEADER,
+                   header.compressed_size) != Z_OK || raw_size != header.raw_size) {
+        std::cerr << "Corrupt frame in session recording at offset " << offset << std::endl;
+        return false;
+    }
+
+    const size_t stride = size_t(header.width) * 3;
+    if (header.type == FRAME_KEYFRAME) {
+        if (m_raw.size() != stride * header.height)
+            return false;
+        m_pixels.swap(m_raw);
+        m_width = header.width;
+        m_height = header.height;
+        m_have_frame = true;
+        return true;
+    }
+
+    if (header.type != FRAME_DELTA || !m_have_frame
+            || header.width != m_width || header.height != m_height)
+        return false;
+
+    size_t pos = 0;
+    while (pos + SESSION_RECT_HEADER <= m_raw.size()) {
+        const unsigned char *rect = m_raw.data() + pos;
+        const int x = get_be16(rect);
+        const int y = get_be16(rect + 2);
+        const int width = get_be16(rect + 4);
+        const int height = get_be16(rect + 6);
+        const size_t rect_stride = size_t(width) * 3;
+        pos += SESSION_RECT_HEADER;
+        if (x + width > m_width || y + height > m_height
+                || pos + rect_stride * height > m_raw.size())
+            return false;
+        for (int row = 0; row < height; ++row) {
+            memcpy(m_pixels.data() + (y + row) * stride + x * 3,
+                   m_raw.data() + pos, rect_stride);
+            pos += rect_stride;
+        }
+    }
+    return true;
+}
+
+Glib::RefPtr<Gdk::Pixbuf> SessionPlayback::frame_at(uint32_t time_ms)
+{
+    if (m_keyframes.empty())
+        return {};
+
+    // The last keyframe at or before time_ms, or the first one
+    auto keyframe = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), time_ms,
+                                     [](uint32_t time, const IndexEntry &entry) {
+        return time < entry.time_ms;
+    });
+    if (keyframe != m_keyframes.begin())
+        --keyframe;
+
+    FrameHeader header;
+    const bool continue_forward = m_have_frame && m_next_frame > keyframe->offset
+                                  && m_time <= time_ms;
+    if (!continue_forward) {
+        m_have_frame = false;
+        if (!read_header(keyframe->offset, header) || !apply_frame(keyframe->offset, header))
+            return {};
+    }
+    while (read_header(m_next_frame, header) && header.time_ms <= time_ms) {
+        if (!apply_frame(m_next_frame, header))
+            break;
+    }
+    if (!m_have_frame)
+        return {};
+
+    auto pixbuf = Gdk::Pixbuf::create(Gdk::COLORSPACE_RGB, false, 8, m_width, m_height);
+    const size_t stride = size_t(m_width) * 3;
+    guint8 *pixels = pixbuf->get_pixels();
+    for (int row = 0; row < m_height; ++row)
+        memcpy(pixels + row * pixbuf->get_rowstride(), m_pixels.data() + row * stride, stride);
+    return pixbuf;
+}
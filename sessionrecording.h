@@ -0,0 +1,161 @@
+/* This file is part of gsshvnc.
+ *
+ * gsshvnc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * gsshvnc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gsshvnc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SESSIONRECORDING_H
+#define _SESSIONRECORDING_H
+
+#include <gdkmm/pixbuf.h>
+#include <glib.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Session recordings hold what the framebuffer showed over time, rather
+ * than the RFB stream, so they play back without a VNC client and can be
+ * entered at any point:
+ *
+ *   "GSVNCSES", u32 version
+ *   Frames, each a 20 byte header (u32 time in ms, u32 type, u16 width,
+ *   u16 height, u32 raw size, u32 compressed size) and zlib data.
+ *   Keyframes hold the whole framebuffer as 24-bit RGB rows, delta frames
+ *   a list of damaged rectangles (u16 x, y, width, height), each followed
+ *   by its pixels.
+ *   The index:  "GSVNCIDX", u32 duration in ms, u32 keyframe count, then
+ *   each keyframe's time (u32) and file offset (u64).
+ *   The index offset (u64) and "GSVNCEND".
+ *
+ * All integers are big-endian.  The index is written when recording stops;
+ * if it's missing (e.g. after a crash), playback rebuilds it by walking the
+ * frame headers.
+ */
+
+// Writes a session recording from framebuffer snapshots and the damage
+// reported between them.  Used from the GTK thread, but frames are encoded,
+// compressed and written by a thread of the recorder's own.
+class SessionRecorder
+{
+public:
+    SessionRecorder();
+    ~SessionRecorder();
+
+    SessionRecorder(const SessionRecorder &) = delete;
+    SessionRecorder &operator=(const SessionRecorder &) = delete;
+
+    bool open(const std::string &path);
+
+    // Writes the index.  Also done by the destructor.
+    void close();
+
+    void add_damage(int x, int y, int width, int height);
+    bool has_damage() const { return !m_damage.empty(); }
+
+    // Record the damaged parts of framebuffer, or all of it if a keyframe
+    // is due or the size changed.  The framebuffer must not be modified
+    // afterwards.  If the writer is still busy with the previous frame,
+    // that one is replaced and its damage carried over.
+    void add_frame(const Glib::RefPtr<Gdk::Pixbuf> &framebuffer);
+
+private:
+    struct Rect { int x, y, width, height; };
+    struct IndexEntry { uint32_t time_ms; uint64_t offset; };
+
+    std::chrono::steady_clock::time_point m_start;
+    std::vector<Rect> m_damage;
+
+    // The frame waiting for the writer thread
+    std::thread m_writer;
+    std::mutex m_queue_lock;
+    std::condition_variable m_queue_cond;
+    Glib::RefPtr<Gdk::Pixbuf> m_queued_frame;
+    std::vector<Rect> m_queued_damage;
+    uint32_t m_queued_time;
+    bool m_stop;
+    std::atomic_bool m_write_failed;
+
+    // Only used by the writer thread until it has been joined
+    std::ofstream m_file;
+    std::string m_path;
+    uint32_t m_last_time;
+    uint32_t m_last_keyframe;
+    int m_width, m_height;
+    std::vector<IndexEntry> m_index;
+    std::vector<unsigned char> m_raw;
+
+    static void add_rect(std::vector<Rect> &rects, const Rect &rect);
+    void write_queued();
+    void encode_frame(const Glib::RefPtr<Gdk::Pixbuf> &framebuffer,
+                      const std::vector<Rect> &damage, uint32_t time_ms);
+    bool write_frame(uint32_t time_ms, uint32_t type);
+};
+
+// Reads a session recording through a memory mapping, and reconstructs the
+// framebuffer at any point in time from the closest keyframe
+class SessionPlayback
+{
+public:
+    SessionPlayback();
+    ~SessionPlayback();
+
+    SessionPlayback(const SessionPlayback &) = delete;
+    SessionPlayback &operator=(const SessionPlayback &) = delete;
+
+    bool open(const std::string &path);
+
+    uint32_t duration_ms() const { return m_duration; }
+
+    // The framebuffer as it was at time_ms, or null if nothing was recorded
+    // yet.  Moving forward a little continues from the current frame
+    // instead of going back to a keyframe.
+    Glib::RefPtr<Gdk::Pixbuf> frame_at(uint32_t time_ms);
+
+private:
+    struct FrameHeader
+    {
+        uint32_t time_ms;
+        uint32_t type;
+        int width, height;
+        uint32_t raw_size;
+        uint32_t compressed_size;
+    };
+    struct IndexEntry { uint32_t time_ms; uint64_t offset; };
+
+    GMappedFile *m_mapping;
+    const unsigned char *m_data;
+    size_t m_frames_end;
+    uint32_t m_duration;
+    std::vector<IndexEntry> m_keyframes;
+
+    // The frame decoded so far, and where the next one starts
+    std::vector<unsigned char> m_pixels;
+    std::vector<unsigned char> m_raw;
+    int m_width, m_height;
+    size_t m_next_frame;
+    uint32_t m_time;
+    bool m_have_frame;
+
+    bool read_index();
+    void scan_frames();
+    bool read_header(size_t offset, FrameHeader &header) const;
+    bool apply_frame(size_t offset, const FrameHeader &header);
+};
+
+#endif
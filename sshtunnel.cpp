@@ -17,15 +17,46 @@
 #include "sshtunnel.h"
 #include "appsettings.h"
 #include "credstorage.h"
+#include "rfbcapture.h"
 
 #include <gtkmm/dialog.h>
 #include <gtkmm/grid.h>
 #include <gtkmm/entry.h>
 #include <gtkmm/checkbutton.h>
+#include <gtkmm/label.h>
 #include <gtkmm/messagedialog.h>
+#include <glibmm/dispatcher.h>
+#include <glibmm/main.h>
+#include <glibmm/miscutils.h>
 #include <giomm.h>
-#include <list>
+#include <libssh/callbacks.h>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <unordered_set>
 #include <iostream>
+#include <iterator>
+#include <mutex>
+
+#include <cerrno>
+#include <ctime>
+
+#ifdef HAVE_GNUTLS
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#endif
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 7, 90)
 // This was renamed in libssh 0.8.0
@@ -37,24 +68,191 @@
 #define ssh_session_update_known_hosts ssh_write_knownhost
 #endif
 
-#define FORWARD_BUFFER_SIZE 4096
+// Per-direction buffering for each forwarded connection.  Buffers start
+// small and double as needed, so idle clients stay cheap but bulk transfers
+// can use large reads and writes.
+#define FORWARD_BUFFER_INITIAL  (32 * 1024)
+#define FORWARD_BUFFER_MAX      (4 * 1024 * 1024)
+
+// Server-to-client data moved for one client before the loop goes back to
+// polling, so a large framebuffer update can't hold up input events.
+#define FORWARD_DOWNSTREAM_SLICE    (256 * 1024)
+
+// Client-to-server coalescing:  Once reads of at least FORWARD_COALESCE_BULK
+// bytes show bulk data is flowing, small batches are held for up to
+// FORWARD_COALESCE_DELAY (rounded up to poll()'s millisecond resolution) to
+// fill a full SSH channel packet.  Small, sporadic reads (like input events)
+// are always sent right away.
+#define FORWARD_COALESCE_PACKET (32 * 1024)
+#define FORWARD_COALESCE_BULK   (4 * 1024)
+#define FORWARD_COALESCE_DELAY  std::chrono::microseconds(200)
+
+// Kernel buffer size for the local end of forwarded connections
+#define FORWARD_SOCKET_BUFFER   (256 * 1024)
+
+// libssh tops channel receive windows back up to this size (its
+// WINDOW_DEFAULT) once they drop below half of it.  Auto-tuning only takes
+// over for windows of at least twice that, and tops them up at half, so
+// libssh never refills them behind our back.
+#define LIBSSH_WINDOW_DEFAULT   1280000u
+#define WINDOW_TUNING_MIN       (2 * LIBSSH_WINDOW_DEFAULT)
+
+// Round trip time assumed until a channel open has been timed
+#define WINDOW_DEFAULT_RTT      std::chrono::milliseconds(100)
+
+// How often the forward thread updates the throughput figures in stats()
+#define STATS_RATE_INTERVAL     std::chrono::milliseconds(500)
+
+// Counters are only written by their forward thread, so a relaxed load and
+// store is enough, and is cheaper than a locked add
+template <typename Counter, typename Value>
+static inline void add_counter(std::atomic<Counter> &counter, Value value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+}
+
+static inline uint64_t usec_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+}
+
+// Adds the time spent in a scope to a counter
+class ScopeTimer
+{
+public:
+    explicit ScopeTimer(std::atomic<uint64_t> &counter)
+        : m_counter(counter), m_start(std::chrono::steady_clock::now()) { }
+
+    ~ScopeTimer() { add_counter(m_counter, usec_since(m_start)); }
+
+private:
+    std::atomic<uint64_t> &m_counter;
+    std::chrono::steady_clock::time_point m_start;
+};
 
 SshTunnel::SshTunnel(Gtk::Window &parent)
-    : m_parent(parent), m_ssh(), m_remote_port(), m_eof(false)
-{ }
+    : m_parent(parent), m_ssh(), m_port_first(), m_port_last(), m_next_port(),
+      m_capture_count(), m_eof(false), m_lost(false), m_interactive(true),
+      m_connect_cancel(false), m_connect_timeout(), m_connect_event(),
+      m_ui_dispatcher(), m_progress_label(), m_keepalive_interval(), m_keepalive_count(),
+      m_profile(PROFILE_DEFAULT), m_session_profile(PROFILE_DEFAULT),
+      m_is_stripe(false), m_session_count(1), m_next_stripe(0),
+      m_lost_reason(LINK_ERROR), m_lost_dispatcher(new Glib::Dispatcher), m_event(),
+      m_last_fd_port(0), m_reconnect_pending(false), m_use_spare(false),
+      m_downstream_backlog(false), m_holding_batches(false),
+      m_local_reads(0), m_channel_writes(0), m_upstream_bytes(0),
+      m_max_window(0), m_window_size(0), m_window_stalls(0), m_rtt_usec(0),
+      m_downstream_bytes(0), m_upstream_rate(0), m_downstream_rate(0), m_upstream_stalls(0),
+      m_downstream_stalls(0), m_channels_opened(0), m_open_usec_total(0), m_wakeups(0),
+      m_poll_usec(0), m_ssh_usec(0), m_local_io_usec(0), m_cpu_usec(0),
+      m_channel_list(std::make_shared<const ChannelList>()), m_rates_upstream(0),
+      m_rates_downstream(0)
+{
+    // Emitted from the forward thread, and delivered on the main loop
+    m_lost_dispatcher->connect([this]() {
+        if (!m_lost)
+            return;
+
+        LinkFailure reason;
+        Glib::ustring message;
+        {
+            std::lock_guard<std::mutex> lock(m_command_lock);
+            reason = m_lost_reason;
+            message = m_lost_message;
+        }
+        m_signal_transport_lost.emit(reason, message);
+    });
+}
 
 SshTunnel::~SshTunnel()
 {
     disconnect();
 }
 
-bool SshTunnel::connect(const Glib::ustring &server, const Glib::ustring &username)
+bool SshTunnel::connect(const Glib::ustring &server, const Glib::ustring &username,
+                        bool interactive)
 {
     disconnect();
-    m_ssh = ssh_new();
+    new_session(server, username);
+    m_interactive = interactive;
+    m_connect_cancel = false;
+
+    Glib::Dispatcher dispatcher;
+    dispatcher.connect([this]() { run_ui_calls(); });
+    m_ui_dispatcher = &dispatcher;
+
+    // Without a user to watch it, e.g. when reconnecting in the background,
+    // there's no progress dialog, and a nested main loop waits instead
+    std::unique_ptr<Gtk::Dialog> progress;
+    Gtk::Label *label = nullptr;
+    if (interactive) {
+        progress = std::make_unique<Gtk::Dialog>("SSH Connection", m_parent, true);
+        progress->add_button("_Cancel", Gtk::RESPONSE_CANCEL);
+        label = Gtk::manage(new Gtk::Label(
+                            Glib::ustring::compose("Connecting to %1...", m_hostname)));
+        label->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_CENTER);
+        auto vbox = dynamic_cast<Gtk::Container *>(progress->get_child());
+        vbox->set_border_width(10);
+        vbox->add(*label);
+        m_progress_label = label;
+    }
+    auto wait_loop = Glib::MainLoop::create();
+
+    // The worker owns m_ssh until it posts its result, which is the last
+    // thing it does, so the main loop never touches the session meanwhile
+    bool finished = false;
+    bool connected = false;
+    std::thread worker([this, &progress, &wait_loop, &finished, &connected]() {
+        bool result = connect_session();
+        post_ui([&progress, &wait_loop, &finished, &connected, result]() {
+            connected = result;
+            finished = true;
+            if (progress)
+                progress->response(Gtk::RESPONSE_OK);
+            else
+                wait_loop->quit();
+        });
+    });
+
+    if (progress) {
+        progress->show_all();
+        while (!finished) {
+            int response = progress->run();
+            if (!finished && response != Gtk::RESPONSE_OK) {
+                // The worker notices this at its next poll, at most 100ms later
+                m_connect_cancel = true;
+                label->set_text("Cancelling...");
+                progress->set_response_sensitive(Gtk::RESPONSE_CANCEL, false);
+            }
+        }
+        progress->hide();
+    } else {
+        wait_loop->run();
+    }
+    worker.join();
 
+    m_ui_dispatcher = nullptr;
+    m_progress_label = nullptr;
+    m_ui_calls.clear();
+
+    if (!connected) {
+        disconnect();
+        return false;
+    }
+
+    open_stripes();
+    return true;
+}
+
+void SshTunnel::new_session(const Glib::ustring &server, const Glib::ustring &username)
+{
+    m_ssh = ssh_new();
     m_eof = false;
+    m_lost = false;
     m_hostname = server;
+    m_username = username;
     std::string hostname_no_port = m_hostname;
     std::string port;
 
@@ -73,18 +271,339 @@ bool SshTunnel::connect(const Glib::ustring &server, const Glib::ustring &userna
     ssh_options_set(m_ssh, SSH_OPTIONS_PORT_STR, port.c_str());
     ssh_options_set(m_ssh, SSH_OPTIONS_USER, username.c_str());
 
-    if (ssh_connect(m_ssh) != SSH_OK) {
-        auto text = Glib::ustring::compose("Error connecting to %1: %2", m_hostname,
-                                           ssh_get_error(m_ssh));
-        Gtk::MessageDialog dialog(m_parent, text, false, Gtk::MESSAGE_ERROR);
-        (void)dialog.run();
+    load_settings();
+}
+
+bool SshTunnel::attach(ssh_session session, const Glib::ustring &server,
+                       const Glib::ustring &username)
+{
+    disconnect();
+    m_ssh = session;
+    m_eof = false;
+    m_lost = false;
+    m_hostname = server;
+    m_username = username;
+    m_server_desc = Glib::ustring::compose("%1@%2", username, server);
+
+    // Benchmark runs must not depend on whatever the user has in
+    // settings.ini, so this uses the shipped defaults with one session
+    m_connect_timeout = 30;
+    m_keepalive_interval = 5;
+    m_keepalive_count = 3;
+    m_use_spare = false;
+    m_max_window = 16 * 1024 * 1024;
+    m_session_count = 1;
+    m_interactive = false;
+    m_session_profile = m_profile;
+    return ssh_is_connected(m_ssh);
+}
+
+void SshTunnel::load_settings()
+{
+    AppSettings settings;
+    m_connect_timeout = settings.get_ssh_connect_timeout();
+    m_keepalive_interval = settings.get_ssh_keepalive_interval();
+    m_keepalive_count = settings.get_ssh_keepalive_count();
+    m_use_spare = settings.get_ssh_spare_channel();
+    m_max_window = settings.get_ssh_max_window();
+    m_session_count = m_is_stripe ? 1 : settings.get_ssh_sessions();
+}
+
+void SshTunnel::open_stripes()
+{
+    if (m_session_count <= 1)
+        return;
+
+    // The extra sessions connect all at once in the background.  They
+    // authenticate the same way without asking again:  Keys and the agent
+    // work as before, and a password is reused from memory.
+    std::vector<std::unique_ptr<SshTunnel>> stripes;
+    for (int i = 1; i < m_session_count; ++i) {
+        auto stripe = std::make_unique<SshTunnel>(m_parent);
+        stripe->m_is_stripe = true;
+        stripe->m_profile = m_profile;
+        stripe->m_saved_password_desc = m_saved_password_desc;
+        stripe->m_saved_password = m_saved_password;
+        stripe->new_session(m_hostname, m_username);
+        stripe->m_interactive = false;
+        stripe->m_connect_cancel = false;
+        stripes.push_back(std::move(stripe));
+    }
+
+    auto wait_loop = Glib::MainLoop::create();
+    Glib::Dispatcher dispatcher;
+    std::atomic<size_t> finished(0);
+    dispatcher.connect([&wait_loop, &finished, &stripes]() {
+        if (finished == stripes.size())
+            wait_loop->quit();
+    });
+
+    std::vector<std::thread> workers;
+    std::vector<char> connected(stripes.size(), false);
+    for (size_t i = 0; i < stripes.size(); ++i) {
+        workers.emplace_back([&stripes, &connected, &finished, &dispatcher, i]() {
+            connected[i] = stripes[i]->connect_session();
+            ++finished;
+            dispatcher.emit();
+        });
+    }
+    wait_loop->run();
+    for (auto &worker : workers)
+        worker.join();
+
+    for (size_t i = 0; i < stripes.size(); ++i) {
+        if (connected[i] && stripes[i]->start_forward_thread())
+            m_stripes.push_back(std::move(stripes[i]));
+    }
+    if (m_stripes.size() + 1 < static_cast<size_t>(m_session_count)) {
+        std::cerr << "Error opening extra SSH sessions; continuing with "
+                  << (m_stripes.size() + 1) << std::endl;
+    }
+}
+
+bool SshTunnel::attach_stripe(ssh_session session)
+{
+    auto stripe = std::make_unique<SshTunnel>(m_parent);
+    stripe->m_is_stripe = true;
+    if (!stripe->attach(session, m_hostname, m_username) || !stripe->start_forward_thread())
         return false;
+    m_stripes.push_back(std::move(stripe));
+    return true;
+}
+
+SshTunnel *SshTunnel::next_stripe()
+{
+    // Round robin over the sessions that are still up, starting with this
+    // one, which is also the only one the caller watches for failures
+    const size_t count = m_stripes.size() + 1;
+    for (size_t tries = 0; tries < count; ++tries) {
+        size_t index = m_next_stripe++ % count;
+        if (index == 0)
+            return this;
+        if (m_stripes[index - 1]->is_alive())
+            return m_stripes[index - 1].get();
+    }
+    return this;
+}
+
+static void set_socket_option(socket_t fd, int level, int name, int value)
+{
+    if (setsockopt(fd, level, name, reinterpret_cast<const char *>(&value),
+                   sizeof(value)) < 0) {
+        std::cerr << "Error setting socket option " << name << std::endl;
+    }
+}
+
+// Let the kernel detect a dead peer too:  TCP keepalives cover a link with
+// nothing in flight, and TCP_USER_TIMEOUT drops the connection when sent
+// data stays unacknowledged for user_timeout seconds.  That is only a
+// backstop, so it's kept long enough for a slow but live link.
+static void set_socket_keepalive(socket_t fd, int interval, int count, int user_timeout)
+{
+    if (fd == SSH_INVALID_SOCKET || interval <= 0)
+        return;
+
+    auto set_option = [fd](int level, int name, int value) {
+        set_socket_option(fd, level, name, value);
+    };
+
+    set_option(SOL_SOCKET, SO_KEEPALIVE, 1);
+#ifdef TCP_KEEPIDLE
+    set_option(IPPROTO_TCP, TCP_KEEPIDLE, interval);
+#endif
+#ifdef TCP_KEEPINTVL
+    set_option(IPPROTO_TCP, TCP_KEEPINTVL, interval);
+#endif
+#ifdef TCP_KEEPCNT
+    set_option(IPPROTO_TCP, TCP_KEEPCNT, count);
+#endif
+#ifdef TCP_USER_TIMEOUT
+    set_option(IPPROTO_TCP, TCP_USER_TIMEOUT, user_timeout * 1000);
+#endif
+    (void)count;
+    (void)user_timeout;
+}
+
+SshTunnel::TransportProfile SshTunnel::profile_from_name(const Glib::ustring &name)
+{
+    if (name == "lan")
+        return PROFILE_LAN;
+    if (name == "wan")
+        return PROFILE_WAN;
+    if (name == "low-bandwidth")
+        return PROFILE_LOW_BANDWIDTH;
+    return PROFILE_DEFAULT;
+}
+
+#ifdef HAVE_GNUTLS
+// Bytes per second one cipher manages on this CPU, encrypting SSH-packet
+// sized buffers for a fixed amount of time
+static double cipher_throughput(gnutls_cipher_algorithm_t algorithm,
+                                std::chrono::milliseconds duration)
+{
+    std::vector<unsigned char> key(gnutls_cipher_get_key_size(algorithm), 0x5a);
+    gnutls_datum_t key_datum = { key.data(), static_cast<unsigned int>(key.size()) };
+    gnutls_aead_cipher_hd_t handle;
+    if (gnutls_aead_cipher_init(&handle, algorithm, &key_datum) < 0)
+        return 0.0;
+
+    const size_t tag_size = 16;
+    std::vector<unsigned char> plain(32 * 1024, 0xa5);
+    std::vector<unsigned char> cipher(plain.size() + tag_size);
+    unsigned char nonce[12] = { };
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto end = start + duration;
+    size_t bytes = 0;
+    auto now = start;
+    while (now < end) {
+        size_t cipher_size = cipher.size();
+        if (gnutls_aead_cipher_encrypt(handle, nonce, sizeof(nonce), nullptr, 0, tag_size,
+                                       plain.data(), plain.size(),
+                                       cipher.data(), &cipher_size) < 0) {
+            bytes = 0;
+            break;
+        }
+        ++nonce[0];
+        bytes += plain.size();
+        now = std::chrono::steady_clock::now();
+    }
+    gnutls_aead_cipher_deinit(handle);
+
+    std::chrono::duration<double> elapsed = now - start;
+    return (elapsed.count() > 0.0) ? bytes / elapsed.count() : 0.0;
+}
+#endif
+
+std::string SshTunnel::cipher_preference()
+{
+    static std::once_flag measured;
+    static std::string preference;
+    std::call_once(measured, []() {
+        struct Candidate
+        {
+            const char *name;
+            double throughput;
+        };
+        std::vector<Candidate> candidates = {
+            { "aes128-gcm@openssh.com", 0.0 },
+            { "chacha20-poly1305@openssh.com", 0.0 },
+            { "aes256-gcm@openssh.com", 0.0 },
+        };
+
+#ifdef HAVE_GNUTLS
+        const std::chrono::milliseconds duration(20);
+        candidates[0].throughput = cipher_throughput(GNUTLS_CIPHER_AES_128_GCM, duration);
+        candidates[1].throughput = cipher_throughput(GNUTLS_CIPHER_CHACHA20_POLY1305, duration);
+        candidates[2].throughput = cipher_throughput(GNUTLS_CIPHER_AES_256_GCM, duration);
+        std::stable_sort(candidates.begin(), candidates.end(),
+                         [](const Candidate &a, const Candidate &b) {
+            return a.throughput > b.throughput;
+        });
+#endif
+
+        for (const auto &candidate : candidates) {
+            preference += candidate.name;
+            preference += ',';
+        }
+
+        // Fallbacks for servers (or libssh builds) without AEAD ciphers
+        preference += "aes128-ctr,aes256-ctr";
+    });
+    return preference;
+}
+
+void SshTunnel::apply_transport_profile()
+{
+    m_session_profile = m_profile;
+    if (m_profile == PROFILE_DEFAULT)
+        return;
+
+    // Only used with the non-AEAD fallback ciphers
+    static const char macs[] = "hmac-sha2-256-etm@openssh.com,hmac-sha2-512-etm@openssh.com,"
+                               "hmac-sha2-256,hmac-sha2-512";
+
+    auto ciphers = cipher_preference();
+    if (ssh_options_set(m_ssh, SSH_OPTIONS_CIPHERS_C_S, ciphers.c_str()) < 0
+            || ssh_options_set(m_ssh, SSH_OPTIONS_CIPHERS_S_C, ciphers.c_str()) < 0) {
+        std::cerr << "Error setting SSH ciphers: " << ssh_get_error(m_ssh) << std::endl;
+    }
+    if (ssh_options_set(m_ssh, SSH_OPTIONS_HMAC_C_S, macs) < 0
+            || ssh_options_set(m_ssh, SSH_OPTIONS_HMAC_S_C, macs) < 0) {
+        std::cerr << "Error setting SSH MACs: " << ssh_get_error(m_ssh) << std::endl;
+    }
+
+    // VNC encodings are mostly compressed already, so zlib only pays off
+    // when bandwidth is scarce
+    int compression_level = 0;
+    if (m_profile == PROFILE_WAN)
+        compression_level = 1;
+    else if (m_profile == PROFILE_LOW_BANDWIDTH)
+        compression_level = 6;
+    ssh_options_set(m_ssh, SSH_OPTIONS_COMPRESSION, compression_level ? "yes" : "no");
+    if (compression_level)
+        ssh_options_set(m_ssh, SSH_OPTIONS_COMPRESSION_LEVEL, &compression_level);
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 8, 0)
+    // A LAN session keeps libssh's per-cipher data limit; slower links
+    // rekey more often, which costs a round trip at most every hour
+    if (m_profile != PROFILE_LAN) {
+        uint64_t rekey_data = 1024ull * 1024 * 1024;
+        uint32_t rekey_time = 60 * 60;
+        ssh_options_set(m_ssh, SSH_OPTIONS_REKEY_DATA, &rekey_data);
+        ssh_options_set(m_ssh, SSH_OPTIONS_REKEY_TIME, &rekey_time);
+    }
+#endif
+}
+
+bool SshTunnel::connect_session()
+{
+    // This may run the cipher benchmark, so keep it off the main thread
+    apply_transport_profile();
+
+    // Run libssh in non-blocking mode, so we can poll for cancellation and
+    // enforce our own timeouts instead of hanging in ssh_connect()
+    ssh_set_blocking(m_ssh, 0);
+    bool result = handshake();
+    if (m_connect_event) {
+        ssh_event_remove_session(m_connect_event, m_ssh);
+        ssh_event_free(m_connect_event);
+        m_connect_event = nullptr;
     }
+    ssh_set_blocking(m_ssh, 1);
+    return result;
+}
 
+bool SshTunnel::handshake()
+{
+    int result;
+    if (!wait_for(SSH_AGAIN, result, [this]() { return ssh_connect(m_ssh); }))
+        return false;
+    if (result != SSH_OK) {
+        show_error(Glib::ustring::compose("Error connecting to %1: %2", m_hostname,
+                                          ssh_get_error(m_ssh)));
+        return false;
+    }
+    // Unanswered keepalives are caught by tunnel_server() itself, so the
+    // kernel never gives up sooner than that, nor sooner than we'd wait for
+    // a round trip here
+    set_socket_keepalive(ssh_get_fd(m_ssh), m_keepalive_interval, m_keepalive_count,
+                         std::max(m_connect_timeout, m_keepalive_interval * m_keepalive_count));
+
+    // Input events are a few bytes each, and must not wait for Nagle to
+    // coalesce them.  The buffer sizes are left to the kernel, since fixing
+    // them would disable receive window autotuning on long, fast links.
+    if (ssh_get_fd(m_ssh) != SSH_INVALID_SOCKET)
+        set_socket_option(ssh_get_fd(m_ssh), IPPROTO_TCP, TCP_NODELAY, 1);
+
+    set_progress(Glib::ustring::compose("Verifying host key for %1...", m_hostname));
     if (!verify_host())
         return false;
 
-    if (ssh_userauth_none(m_ssh, nullptr) == SSH_AUTH_SUCCESS)
+    set_progress(Glib::ustring::compose("Authenticating %1...", m_server_desc));
+    if (!wait_for(SSH_AUTH_AGAIN, result, [this]() { return ssh_userauth_none(m_ssh, nullptr); }))
+        return false;
+    if (result == SSH_AUTH_SUCCESS)
         return true;
     auto auth_methods = ssh_userauth_list(m_ssh, nullptr);
     if (auth_methods == 0) {
@@ -95,25 +614,141 @@ bool SshTunnel::connect(const Glib::ustring &server, const Glib::ustring &userna
     }
 
     // TODO: Support SSH public keys with a passphrase
-    if ((auth_methods & SSH_AUTH_METHOD_PUBLICKEY)
-            && (ssh_userauth_publickey_auto(m_ssh, nullptr, "") == SSH_AUTH_SUCCESS))
-        return true;
+    if (auth_methods & SSH_AUTH_METHOD_PUBLICKEY) {
+        if (!wait_for(SSH_AUTH_AGAIN, result, [this]() {
+                return ssh_userauth_publickey_auto(m_ssh, nullptr, "");
+            }))
+            return false;
+        if (result == SSH_AUTH_SUCCESS)
+            return true;
+    }
 
     if ((auth_methods & SSH_AUTH_METHOD_PASSWORD) && prompt_password())
         return true;
 
-    if ((auth_methods & SSH_AUTH_METHOD_INTERACTIVE) && interactive())
+    if (!m_connect_cancel && (auth_methods & SSH_AUTH_METHOD_INTERACTIVE) && interactive())
         return true;
 
     return false;
 }
 
+bool SshTunnel::wait_for(int again, int &result, const std::function<int ()> &step)
+{
+    // The timeout covers each network round trip, not time spent in prompts
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(m_connect_timeout);
+    bool use_event = true;
+    for ( ;; ) {
+        result = step();
+        if (result != again)
+            return true;
+        if (m_connect_cancel)
+            return false;
+        if (std::chrono::steady_clock::now() >= deadline) {
+            show_error(Glib::ustring::compose("Timed out connecting to %1", m_hostname));
+            return false;
+        }
+
+        // The session can only be added to an event once its socket exists,
+        // which is after the first call to ssh_connect()
+        if (use_event && !m_connect_event) {
+            m_connect_event = ssh_event_new();
+            if (ssh_event_add_session(m_connect_event, m_ssh) != SSH_OK) {
+                ssh_event_free(m_connect_event);
+                m_connect_event = nullptr;
+                use_event = false;
+            }
+        }
+        if (m_connect_event)
+            ssh_event_dopoll(m_connect_event, 100);
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+void SshTunnel::post_ui(std::function<void ()> call)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_ui_lock);
+        m_ui_calls.emplace_back(std::move(call));
+    }
+    m_ui_dispatcher->emit();
+}
+
+template <typename Result>
+Result SshTunnel::call_ui(const std::function<Result ()> &call)
+{
+    std::promise<Result> promise;
+    post_ui([&promise, &call]() {
+        promise.set_value(call());
+    });
+    return promise.get_future().get();
+}
+
+void SshTunnel::run_ui_calls()
+{
+    std::vector<std::function<void ()>> calls;
+    {
+        std::lock_guard<std::mutex> lock(m_ui_lock);
+        calls.swap(m_ui_calls);
+    }
+    for (const auto &call : calls)
+        call();
+}
+
+void SshTunnel::set_progress(const Glib::ustring &text)
+{
+    // Extra sessions connect without any UI
+    if (!m_ui_dispatcher)
+        return;
+    post_ui([this, text]() {
+        if (m_progress_label)
+            m_progress_label->set_text(text);
+    });
+}
+
+void SshTunnel::show_error(const Glib::ustring &text)
+{
+    if (!m_interactive) {
+        std::cerr << text << std::endl;
+        return;
+    }
+
+    (void)call_ui<int>([this, &text]() {
+        Gtk::MessageDialog dialog(m_parent, text, false, Gtk::MESSAGE_ERROR);
+        return dialog.run();
+    });
+}
+
+void SshTunnel::report_error(const Glib::ustring &text)
+{
+    // A background reconnect just fails, and the caller retries later
+    std::cerr << text << std::endl;
+    if (!m_interactive)
+        return;
+
+    Gtk::MessageDialog dialog(m_parent, text, false, Gtk::MESSAGE_ERROR);
+    (void)dialog.run();
+}
+
 void SshTunnel::disconnect()
 {
     if (m_ssh) {
         m_eof = true;
-        if (m_forward_thread.joinable())
+        if (m_forward_thread.joinable()) {
+            wakeup();
             m_forward_thread.join();
+        }
+        m_wakeup_read.reset();
+        m_wakeup_write.reset();
+        m_commands.clear();
+        m_forwards.clear();
+        m_local_sockets.clear();
+        m_stripes.clear();
+
+        // The next session may go to a different host, so window sizing
+        // starts over from its own round trips
+        m_rtt_usec = 0;
+        m_window_size = 0;
         if (ssh_is_connected(m_ssh))
             ssh_disconnect(m_ssh);
         ssh_free(m_ssh);
@@ -121,9 +756,120 @@ void SshTunnel::disconnect()
     m_ssh = nullptr;
 }
 
-#define TUNNEL_PORT_OFFSET 5500
+bool SshTunnel::is_alive() const
+{
+    if (!m_ssh || m_lost)
+        return false;
+
+    // Once the forward thread is running it owns the session, and reports
+    // a dead transport through m_lost instead
+    if (m_forward_thread.joinable())
+        return true;
+    return ssh_is_connected(m_ssh);
+}
+
+struct SshTunnel::ChannelCounters
+{
+    // Set before the counters are published, and constant after that
+    std::string target;
+
+    std::atomic<uint64_t> upstream_bytes;
+    std::atomic<uint64_t> downstream_bytes;
+    std::atomic<uint64_t> queued_upstream;
+    std::atomic<uint64_t> queued_downstream;
+    std::atomic<uint64_t> upstream_stalls;
+    std::atomic<uint64_t> downstream_stalls;
+    std::atomic<uint32_t> window_size;
+    std::atomic<uint32_t> open_usec;
+
+    ChannelCounters()
+        : upstream_bytes(0), downstream_bytes(0), queued_upstream(0), queued_downstream(0),
+          upstream_stalls(0), downstream_stalls(0), window_size(0), open_usec(0) { }
+};
+
+SshTunnel::Stats SshTunnel::stats() const
+{
+    Stats stats;
+    stats.upstream_bytes = m_upstream_bytes;
+    stats.downstream_bytes = m_downstream_bytes;
+    stats.upstream_rate = m_upstream_rate;
+    stats.downstream_rate = m_downstream_rate;
+    stats.local_reads = m_local_reads;
+    stats.channel_writes = m_channel_writes;
+    stats.queued_bytes = 0;
+    for (const auto &channel : *std::atomic_load(&m_channel_list))
+        stats.queued_bytes += channel->queued_upstream + channel->queued_downstream;
+    stats.upstream_stalls = m_upstream_stalls;
+    stats.downstream_stalls = m_downstream_stalls;
+    stats.window_size = m_window_size;
+    stats.window_stalls = m_window_stalls;
+    stats.rtt_usec = m_rtt_usec;
+    stats.channels_opened = m_channels_opened;
+    stats.open_usec_total = m_open_usec_total;
+    stats.wakeups = m_wakeups;
+    stats.poll_usec = m_poll_usec;
+    stats.ssh_usec = m_ssh_usec;
+    stats.local_io_usec = m_local_io_usec;
+    stats.cpu_usec = m_cpu_usec;
+
+    for (const auto &stripe : m_stripes) {
+        auto stripe_stats = stripe->stats();
+        stats.upstream_bytes += stripe_stats.upstream_bytes;
+        stats.downstream_bytes += stripe_stats.downstream_bytes;
+        stats.upstream_rate += stripe_stats.upstream_rate;
+        stats.downstream_rate += stripe_stats.downstream_rate;
+        stats.local_reads += stripe_stats.local_reads;
+        stats.channel_writes += stripe_stats.channel_writes;
+        stats.queued_bytes += stripe_stats.queued_bytes;
+        stats.upstream_stalls += stripe_stats.upstream_stalls;
+        stats.downstream_stalls += stripe_stats.downstream_stalls;
+        stats.window_size = std::max(stats.window_size, stripe_stats.window_size);
+        stats.window_stalls += stripe_stats.window_stalls;
+        if (stripe_stats.rtt_usec && (!stats.rtt_usec || stripe_stats.rtt_usec < stats.rtt_usec))
+            stats.rtt_usec = stripe_stats.rtt_usec;
+        stats.channels_opened += stripe_stats.channels_opened;
+        stats.open_usec_total += stripe_stats.open_usec_total;
+        stats.wakeups += stripe_stats.wakeups;
+        stats.poll_usec += stripe_stats.poll_usec;
+        stats.ssh_usec += stripe_stats.ssh_usec;
+        stats.local_io_usec += stripe_stats.local_io_usec;
+        stats.cpu_usec += stripe_stats.cpu_usec;
+    }
+    return stats;
+}
+
+std::vector<SshTunnel::ChannelStats> SshTunnel::channel_stats() const
+{
+    std::vector<ChannelStats> result;
+    for (const auto &channel : *std::atomic_load(&m_channel_list)) {
+        ChannelStats stats;
+        stats.target = channel->target;
+        stats.upstream_bytes = channel->upstream_bytes;
+        stats.downstream_bytes = channel->downstream_bytes;
+        stats.queued_upstream = channel->queued_upstream;
+        stats.queued_downstream = channel->queued_downstream;
+        stats.upstream_stalls = channel->upstream_stalls;
+        stats.downstream_stalls = channel->downstream_stalls;
+        stats.window_size = channel->window_size;
+        stats.open_usec = channel->open_usec;
+        result.push_back(std::move(stats));
+    }
+    for (const auto &stripe : m_stripes) {
+        auto stripe_channels = stripe->channel_stats();
+        std::move(stripe_channels.begin(), stripe_channels.end(), std::back_inserter(result));
+    }
+    return result;
+}
 
-static Glib::RefPtr<Gio::Socket> get_local_socket(Glib::RefPtr<Gio::Cancellable> &cancellable)
+bool SshTunnel::is_connected(const Glib::ustring &server, const Glib::ustring &username) const
+{
+    return is_alive() && m_hostname == server && m_username == username
+           && m_session_profile == m_profile;
+}
+
+static Glib::RefPtr<Gio::Socket> get_local_socket(Glib::RefPtr<Gio::Cancellable> &cancellable,
+                                                  guint16 port_first, guint16 port_last,
+                                                  guint16 &next_port)
 {
     Glib::RefPtr<Gio::Socket> sock;
     try {
@@ -140,13 +886,31 @@ static Glib::RefPtr<Gio::Socket> get_local_socket(Glib::RefPtr<Gio::Cancellable>
     if (!loop_addr)
         return {};
 
-    for (guint16 port = TUNNEL_PORT_OFFSET + 99; port > TUNNEL_PORT_OFFSET; --port) {
+    if (port_first == 0) {
+        // No range configured -- let the OS pick any free port
+        try {
+            sock->bind(Gio::InetSocketAddress::create(loop_addr, 0), false);
+            return sock;
+        } catch (Gio::Error &err) {
+            std::cerr << "Error binding SSH forward port: " << err.what() << std::endl;
+            return {};
+        }
+    }
+
+    // Start where the last successful bind left off, so ports we've just
+    // handed out (and likely still hold) aren't retried every time
+    const unsigned int range_size = port_last - port_first + 1;
+    if (next_port < port_first || next_port > port_last)
+        next_port = port_first;
+    for (unsigned int i = 0; i < range_size; ++i) {
+        guint16 port = port_first + (next_port - port_first + i) % range_size;
         auto addr = Gio::InetSocketAddress::create(loop_addr, port);
         if (!addr)
             return {};
 
         try {
-            sock->bind(addr, false);
+            sock->bind(addr, true);
+            next_port = (port == port_last) ? port_first : port + 1;
             return sock;
         } catch (Gio::Error &) {
             /* Fail to bind -- try next port */
@@ -156,85 +920,370 @@ static Glib::RefPtr<Gio::Socket> get_local_socket(Glib::RefPtr<Gio::Cancellable>
     return {};
 }
 
-guint16 SshTunnel::forward_port(const Glib::ustring &remote_host, int remote_port)
+bool SshTunnel::create_socket_pair(Glib::RefPtr<Gio::Socket> &first,
+                                   Glib::RefPtr<Gio::Socket> &second)
 {
-    Glib::RefPtr<Gio::Cancellable> cancellable;
-    m_forward_socket = get_local_socket(cancellable);
-    if (!m_forward_socket)
-        return 0;
+#ifdef _WIN32
+    // Windows has no socketpair(), so connect two sockets over loopback
+    try {
+        auto loop_addr = Gio::InetAddress::create_loopback(Gio::SOCKET_FAMILY_IPV4);
+        auto listener = Gio::Socket::create(Gio::SOCKET_FAMILY_IPV4, Gio::SOCKET_TYPE_STREAM,
+                                            Gio::SOCKET_PROTOCOL_TCP);
+        listener->bind(Gio::InetSocketAddress::create(loop_addr, 0), false);
+        listener->listen();
+        first = Gio::Socket::create(Gio::SOCKET_FAMILY_IPV4, Gio::SOCKET_TYPE_STREAM,
+                                    Gio::SOCKET_PROTOCOL_TCP);
+        first->connect(listener->get_local_address());
+        second = listener->accept();
+    } catch (Gio::Error &err) {
+        std::cerr << "Error creating socket pair: " << err.what() << std::endl;
+        return false;
+    }
+#else
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        std::cerr << "Error creating socket pair: " << g_strerror(errno) << std::endl;
+        return false;
+    }
+    try {
+        first = Gio::Socket::create_from_fd(fds[0]);
+    } catch (Gio::Error &err) {
+        std::cerr << "Error creating socket pair: " << err.what() << std::endl;
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    try {
+        second = Gio::Socket::create_from_fd(fds[1]);
+    } catch (Gio::Error &err) {
+        std::cerr << "Error creating socket pair: " << err.what() << std::endl;
+        first.reset();
+        close(fds[1]);
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool SshTunnel::start_forward_thread()
+{
+    if (m_forward_thread.joinable())
+        return true;
 
     int ssh_fd = ssh_get_fd(m_ssh);
     if (ssh_fd < 0) {
-        auto text = Glib::ustring::compose("Error getting SSH handle: %1", ssh_get_error(m_ssh));
-        Gtk::MessageDialog dialog(m_parent, text, false, Gtk::MESSAGE_ERROR);
-        (void)dialog.run();
-        return 0;
+        report_error(Glib::ustring::compose("Error getting SSH handle: %1",
+                                            ssh_get_error(m_ssh)));
+        return false;
     }
 
-    m_remote_host = remote_host;
-    m_remote_port = remote_port;
-
-    m_forward_socket->set_listen_backlog(5);
-    try {
-        m_forward_socket->listen();
-    } catch (Gio::Error &err) {
-        auto text = Glib::ustring::compose("Error listening on SSH forward port: %1", err.what());
-        Gtk::MessageDialog dialog(m_parent, text, false, Gtk::MESSAGE_ERROR);
-        (void)dialog.run();
-        return 0;
+    if (!create_socket_pair(m_wakeup_read, m_wakeup_write)) {
+        report_error("Error creating SSH forward thread");
+        return false;
     }
-    m_forward_thread = std::thread([this, cancellable, ssh_fd]() {
-        tunnel_server(ssh_fd);
-    });
+    m_wakeup_read->set_blocking(false);
+    m_wakeup_write->set_blocking(false);
 
-    auto local_address = Glib::RefPtr<Gio::InetSocketAddress>::cast_dynamic(m_forward_socket->get_local_address());
-    return local_address->get_port();
+    m_forward_thread = std::thread([this]() {
+        tunnel_server();
+    });
+    return true;
 }
 
-bool SshTunnel::verify_host()
+struct SshTunnel::PortForward : public std::enable_shared_from_this<PortForward>
 {
-#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 8, 0)
-    int state = ssh_is_server_known(m_ssh);
-#else
-    ssh_known_hosts_e state = ssh_session_is_known_server(m_ssh);
-#endif
+    // Null for forwards created by forward_fd()
+    Glib::RefPtr<Gio::Socket> m_listener;
+    guint16 m_local_port;
 
-    ssh_key server_key;
-    if (ssh_get_server_publickey(m_ssh, &server_key) < 0)
-        return false;
+    // The listener's socket file for forward_socks(), removed with it
+    std::string m_local_path;
+    std::string m_remote_host;
+    int m_remote_port;
 
-    unsigned char *hash_buf = nullptr;
-    size_t hash_len;
-    if (ssh_get_publickey_hash(server_key, SSH_PUBLICKEY_HASH_SHA1, &hash_buf, &hash_len) < 0)
-        return false;
-    char *temp = ssh_get_hexa(hash_buf, hash_len);
-    Glib::ustring hash_str(temp);
-    ssh_string_free_char(temp);
-    ssh_clean_pubkey_hash(&hash_buf);
+    // Set instead of m_remote_host for "unix:/path" and "exec:command" targets
+    std::string m_remote_path;
+    std::string m_remote_command;
 
-    switch (state) {
-#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 8, 0)
-    case SSH_SERVER_KNOWN_OK:
-#else
-    case SSH_KNOWN_HOSTS_OK:
-#endif
-        break;
+    // Only accessed from the forward thread
+    SshTunnel *m_tunnel;
+    std::unordered_set<ForwardClient *> m_clients;
 
-#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 8, 0)
-    case SSH_SERVER_KNOWN_CHANGED:
-#else
-    case SSH_KNOWN_HOSTS_CHANGED:
-#endif
-        {
-            auto text = Glib::ustring::compose(
+    // Handed to the client of a forward_fd() forward
+    std::unique_ptr<RfbCapture> m_capture;
+
+    PortForward(SshTunnel *tunnel, const std::string &remote_host, int remote_port)
+        : m_local_port(), m_remote_host(remote_host), m_remote_port(remote_port),
+          m_tunnel(tunnel)
+    {
+        static const std::string unix_prefix = "unix:";
+        static const std::string exec_prefix = "exec:";
+        if (m_remote_host.compare(0, unix_prefix.size(), unix_prefix) == 0) {
+            m_remote_path = m_remote_host.substr(unix_prefix.size());
+            m_remote_host.clear();
+            m_remote_port = 0;
+        } else if (m_remote_host.compare(0, exec_prefix.size(), exec_prefix) == 0) {
+            m_remote_command = m_remote_host.substr(exec_prefix.size());
+            m_remote_host.clear();
+            m_remote_port = 0;
+        }
+    }
+
+    // The same target on another tunnel, without a listener or clients
+    std::shared_ptr<PortForward> copy_for(SshTunnel *tunnel) const
+    {
+        auto copy = std::make_shared<PortForward>(tunnel, m_remote_host, m_remote_port);
+        copy->m_remote_path = m_remote_path;
+        copy->m_remote_command = m_remote_command;
+        return copy;
+    }
+
+    ~PortForward()
+    {
+#ifndef _WIN32
+        if (!m_local_path.empty())
+            (void)unlink(m_local_path.c_str());
+#endif
+    }
+
+    // Dynamic forwards ask each client where to connect with SOCKS5
+    bool is_dynamic() const
+    {
+        return m_remote_host.empty() && m_remote_path.empty() && m_remote_command.empty();
+    }
+
+    // Identifies forwards whose channels are interchangeable, so a spare
+    // channel can be opened ahead of time.  Empty if that isn't possible:
+    // Dynamic forwards don't know their target yet, and opening an exec
+    // channel early would start the remote command.
+    std::string spare_key() const
+    {
+        if (!m_remote_path.empty())
+            return "unix:" + m_remote_path;
+        if (!m_remote_host.empty())
+            return m_remote_host + ":" + std::to_string(m_remote_port);
+        return std::string();
+    }
+};
+
+guint16 SshTunnel::forward_port(const Glib::ustring &remote_host, int remote_port)
+{
+    auto forward = std::make_shared<PortForward>(this, remote_host, remote_port);
+    Glib::RefPtr<Gio::Cancellable> cancellable;
+    forward->m_listener = get_local_socket(cancellable, m_port_first, m_port_last,
+                                           m_next_port);
+    if (!forward->m_listener)
+        return 0;
+
+    auto local_address = Glib::RefPtr<Gio::InetSocketAddress>::cast_dynamic(forward->m_listener->get_local_address());
+    forward->m_local_port = local_address->get_port();
+    if (!start_forward(forward))
+        return 0;
+    return forward->m_local_port;
+}
+
+std::string SshTunnel::forward_socks()
+{
+#ifdef _WIN32
+    std::cerr << "SOCKS forwarding is not supported on Windows" << std::endl;
+    return std::string();
+#else
+    // Anyone who can connect to the proxy can reach the remote network as
+    // us, so it listens in a directory that only we can enter rather than
+    // on a loopback port any local user could use
+    auto dir = Glib::build_filename(g_get_user_runtime_dir(), "gsshvnc");
+    struct stat dir_stat;
+    if (g_mkdir_with_parents(dir.c_str(), 0700) < 0 || lstat(dir.c_str(), &dir_stat) < 0
+            || !S_ISDIR(dir_stat.st_mode) || dir_stat.st_uid != getuid()
+            || chmod(dir.c_str(), 0700) < 0) {
+        std::cerr << "Error creating private directory " << dir << std::endl;
+        return std::string();
+    }
+
+    static std::atomic<unsigned int> proxy_count(0);
+    auto forward = std::make_shared<PortForward>(this, std::string(), 0);
+    auto path = Glib::build_filename(dir, Glib::ustring::compose("socks-%1-%2", getpid(),
+                                                                 ++proxy_count));
+    (void)unlink(path.c_str());
+    try {
+        forward->m_listener = Gio::Socket::create(Gio::SOCKET_FAMILY_UNIX,
+                                                  Gio::SOCKET_TYPE_STREAM,
+                                                  Gio::SOCKET_PROTOCOL_DEFAULT);
+        forward->m_listener->bind(Gio::UnixSocketAddress::create(path), false);
+    } catch (Gio::Error &err) {
+        std::cerr << "Error binding SOCKS socket: " << err.what() << std::endl;
+        return std::string();
+    }
+    forward->m_local_path = path;
+    if (chmod(path.c_str(), 0600) < 0 || !start_forward(forward))
+        return std::string();
+    return path;
+#endif
+}
+
+bool SshTunnel::start_forward(const std::shared_ptr<PortForward> &forward)
+{
+    forward->m_listener->set_listen_backlog(5);
+    try {
+        forward->m_listener->listen();
+    } catch (Gio::Error &err) {
+        report_error(Glib::ustring::compose("Error listening on SSH forward port: %1",
+                                            err.what()));
+        return false;
+    }
+
+    if (!start_forward_thread())
+        return false;
+    post_command([this, forward]() { start_listener(forward); });
+
+    m_forwards.push_back(forward);
+    return true;
+}
+
+void SshTunnel::set_local_port_range(guint16 first, guint16 last)
+{
+    if (first > last)
+        std::swap(first, last);
+    m_port_first = first;
+    m_port_last = last;
+}
+
+int SshTunnel::forward_fd(const Glib::ustring &remote_host, int remote_port)
+{
+    m_last_fd_host = remote_host;
+    m_last_fd_port = remote_port;
+
+    // Captures are numbered here, so stripes don't pick the same name
+    std::unique_ptr<RfbCapture> capture;
+    if (!m_capture_path.empty()) {
+        auto path = m_capture_path;
+        if (++m_capture_count > 1)
+            path += "." + std::to_string(m_capture_count);
+        capture = std::make_unique<RfbCapture>();
+        if (!capture->open(path))
+            capture.reset();
+    }
+
+    // A pending reconnect's spare channel is on this session
+    auto tunnel = m_reconnect_pending ? this : next_stripe();
+    return tunnel->forward_fd(remote_host, remote_port, std::move(capture));
+}
+
+int SshTunnel::forward_fd(const Glib::ustring &remote_host, int remote_port,
+                          std::unique_ptr<RfbCapture> capture)
+{
+    Glib::RefPtr<Gio::Socket> local_end, tunnel_end;
+    if (!create_socket_pair(local_end, tunnel_end)) {
+        report_error("Error creating SSH forward socket");
+        return -1;
+    }
+
+    if (!start_forward_thread())
+        return -1;
+
+    // The channel is opened on the forward thread.  Anything the caller
+    // writes in the meantime just waits in the socket buffer.
+    auto forward = std::make_shared<PortForward>(this, remote_host, remote_port);
+    forward->m_capture = std::move(capture);
+    post_command([this, tunnel_end, forward]() {
+        add_client(tunnel_end, forward, "127.0.0.1", 0);
+    });
+
+    m_local_sockets.push_back(local_end);
+    return local_end->get_fd();
+}
+
+void SshTunnel::transport_lost(LinkFailure reason, const Glib::ustring &message)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_command_lock);
+        m_lost_reason = reason;
+        m_lost_message = message;
+    }
+    m_lost = true;
+    m_lost_dispatcher->emit();
+}
+
+void SshTunnel::set_capture_path(const std::string &path)
+{
+    m_capture_path = path;
+    m_capture_count = 0;
+}
+
+void SshTunnel::set_reconnect_pending(bool pending)
+{
+    m_reconnect_pending = pending;
+    if (!m_forward_thread.joinable())
+        return;
+
+    if (!pending) {
+        post_command([this]() { discard_spare(); });
+        return;
+    }
+    if (!m_use_spare || m_last_fd_host.empty())
+        return;
+    auto forward = std::make_shared<PortForward>(this, m_last_fd_host, m_last_fd_port);
+    post_command([this, forward]() { open_spare(forward); });
+}
+
+void SshTunnel::close_forward_fds()
+{
+    // The forward thread sees EOF on the other ends and closes the channels
+    m_local_sockets.clear();
+    for (const auto &stripe : m_stripes)
+        stripe->close_forward_fds();
+}
+
+bool SshTunnel::verify_host()
+{
+#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 8, 0)
+    int state = ssh_is_server_known(m_ssh);
+#else
+    ssh_known_hosts_e state = ssh_session_is_known_server(m_ssh);
+#endif
+
+    ssh_key server_key;
+    if (ssh_get_server_publickey(m_ssh, &server_key) < 0)
+        return false;
+
+    unsigned char *hash_buf = nullptr;
+    size_t hash_len;
+    if (ssh_get_publickey_hash(server_key, SSH_PUBLICKEY_HASH_SHA1, &hash_buf, &hash_len) < 0)
+        return false;
+    char *temp = ssh_get_hexa(hash_buf, hash_len);
+    Glib::ustring hash_str(temp);
+    ssh_string_free_char(temp);
+    ssh_clean_pubkey_hash(&hash_buf);
+
+    switch (state) {
+#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 8, 0)
+    case SSH_SERVER_KNOWN_OK:
+#else
+    case SSH_KNOWN_HOSTS_OK:
+#endif
+        break;
+
+#if LIBSSH_VERSION_INT < SSH_VERSION_INT(0, 8, 0)
+    case SSH_SERVER_KNOWN_CHANGED:
+#else
+    case SSH_KNOWN_HOSTS_CHANGED:
+#endif
+        {
+            auto text = Glib::ustring::compose(
                             "Host key for %1 has changed\n"
                             "New server key: %2\n\n"
                             "Connect anyway? (<b>NOT RECOMMENDED</b> unless you trust the new key)",
                             m_hostname, hash_str);
-            Gtk::MessageDialog dialog(m_parent, text, true, Gtk::MESSAGE_QUESTION,
-                                      Gtk::BUTTONS_YES_NO);
-            int response = dialog.run();
-            if (response == Gtk::RESPONSE_NO)
+            if (!m_interactive) {
+                std::cerr << "Not connecting to unverified host " << m_hostname << std::endl;
+                return false;
+            }
+            int response = call_ui<int>([this, &text]() {
+                Gtk::MessageDialog dialog(m_parent, text, true, Gtk::MESSAGE_QUESTION,
+                                          Gtk::BUTTONS_YES_NO);
+                return dialog.run();
+            });
+            if (response != Gtk::RESPONSE_YES)
                 return false;
         }
         break;
@@ -249,10 +1298,16 @@ bool SshTunnel::verify_host()
                             "The host key for %1 was not found, but another type of key exists.\n"
                             "Connect anyway? (<b>NOT RECOMMENDED</b> unless you trust the new key)",
                             m_hostname);
-            Gtk::MessageDialog dialog(m_parent, text, true, Gtk::MESSAGE_QUESTION,
-                                      Gtk::BUTTONS_YES_NO);
-            int response = dialog.run();
-            if (response == Gtk::RESPONSE_NO)
+            if (!m_interactive) {
+                std::cerr << "Not connecting to unverified host " << m_hostname << std::endl;
+                return false;
+            }
+            int response = call_ui<int>([this, &text]() {
+                Gtk::MessageDialog dialog(m_parent, text, true, Gtk::MESSAGE_QUESTION,
+                                          Gtk::BUTTONS_YES_NO);
+                return dialog.run();
+            });
+            if (response != Gtk::RESPONSE_YES)
                 return false;
         }
         break;
@@ -270,17 +1325,21 @@ bool SshTunnel::verify_host()
                             "Public Key hash: %2\n\n"
                             "Do you trust the host key?",
                             m_hostname, hash_str);
-            Gtk::MessageDialog dialog(m_parent, text, false, Gtk::MESSAGE_QUESTION,
-                                      Gtk::BUTTONS_YES_NO);
-            int response = dialog.run();
-            if (response == Gtk::RESPONSE_NO)
+            if (!m_interactive) {
+                std::cerr << "Not connecting to unverified host " << m_hostname << std::endl;
+                return false;
+            }
+            int response = call_ui<int>([this, &text]() {
+                Gtk::MessageDialog dialog(m_parent, text, false, Gtk::MESSAGE_QUESTION,
+                                          Gtk::BUTTONS_YES_NO);
+                return dialog.run();
+            });
+            if (response != Gtk::RESPONSE_YES)
                 return false;
 
             if (ssh_session_update_known_hosts(m_ssh) < 0) {
-                text = Glib::ustring::compose("Error writing SSH host key: %1",
-                                              ssh_get_error(m_ssh));
-                Gtk::MessageDialog dialog(m_parent, text, false, Gtk::MESSAGE_ERROR);
-                (void)dialog.run();
+                show_error(Glib::ustring::compose("Error writing SSH host key: %1",
+                                                  ssh_get_error(m_ssh)));
                 return false;
             }
         }
@@ -291,20 +1350,12 @@ bool SshTunnel::verify_host()
 #else
     case SSH_KNOWN_HOSTS_ERROR:
 #endif
-        {
-            auto text = Glib::ustring::compose("Error connecting to %1: %2", m_hostname,
-                                               ssh_get_error(m_ssh));
-            Gtk::MessageDialog dialog(m_parent, text, false, Gtk::MESSAGE_ERROR);
-            (void)dialog.run();
-        }
+        show_error(Glib::ustring::compose("Error connecting to %1: %2", m_hostname,
+                                          ssh_get_error(m_ssh)));
         return false;
 
     default:
-        {
-            auto text = Glib::ustring::compose("Unsupported libssh response: %1", state);
-            Gtk::MessageDialog dialog(m_parent, text, false, Gtk::MESSAGE_ERROR);
-            (void)dialog.run();
-        }
+        show_error(Glib::ustring::compose("Unsupported libssh response: %1", state));
         return false;
     }
 
@@ -313,150 +1364,270 @@ bool SshTunnel::verify_host()
 
 bool SshTunnel::prompt_password()
 {
-    AppSettings settings;
+    int result;
+    if (m_saved_password_desc == m_server_desc && !m_saved_password.empty()) {
+        if (!wait_for(SSH_AUTH_AGAIN, result, [this]() {
+                return ssh_userauth_password(m_ssh, nullptr, m_saved_password.c_str());
+            }))
+            return false;
+        if (result == SSH_AUTH_SUCCESS)
+            return true;
+        m_saved_password.clear();
+    }
+    if (!m_interactive)
+        return false;
 
-    Gtk::Dialog dialog("SSH Authentication", m_parent);
-    dialog.add_button("_Cancel", Gtk::RESPONSE_CANCEL);
-    dialog.add_button("_Ok", Gtk::RESPONSE_OK);
-    dialog.set_default_response(Gtk::RESPONSE_OK);
-
-    auto *grid = Gtk::manage(new Gtk::Grid);
-    grid->set_row_spacing(10);
-    grid->set_column_spacing(5);
-    grid->set_border_width(5);
-    Gtk::Label *hint_label = Gtk::manage(new Gtk::Label("SSH Host:"));
-    hint_label->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_CENTER);
-    Gtk::Label *host_hint = Gtk::manage(new Gtk::Label(m_server_desc));
-    host_hint->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_CENTER);
-    Gtk::Label *label = Gtk::manage(new Gtk::Label("Password:"));
-    label->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_CENTER);
-    Gtk::Entry *password = Gtk::manage(new Gtk::Entry);
-    password->set_activates_default(true);
-    password->set_visibility(false);
-    Gtk::CheckButton *remember = Gtk::manage(new Gtk::CheckButton("_Remember password", true));
-    remember->set_active(settings.get_save_ssh_password());
-
-    grid->attach(*hint_label, 0, 0, 1, 1);
-    grid->attach(*host_hint, 1, 0, 1, 1);
-    grid->attach(*label, 0, 1, 1, 1);
-    grid->attach(*password, 1, 1, 1, 1);
-    grid->attach(*remember, 0, 2, 2, 1);
-
-    auto vbox = dialog.get_child();
-    dynamic_cast<Gtk::Container *>(vbox)->add(*grid);
-
-    CredentialStorage creds;
-    creds.got_ssh_password().connect([password, remember](const Glib::ustring &saved_password) {
-        if (!saved_password.empty()) {
-            password->set_text(saved_password);
-            password->select_region(0, saved_password.size());
-            remember->set_active(true);
-        }
-    });
-    creds.fetch_ssh_password(m_server_desc);
+    Glib::ustring password_text;
+    bool remember_password = false;
+
+    bool accepted = call_ui<bool>([this, &password_text, &remember_password]() {
+        AppSettings settings;
+
+        Gtk::Dialog dialog("SSH Authentication", m_parent);
+        dialog.add_button("_Cancel", Gtk::RESPONSE_CANCEL);
+        dialog.add_button("_Ok", Gtk::RESPONSE_OK);
+        dialog.set_default_response(Gtk::RESPONSE_OK);
+
+        auto *grid = Gtk::manage(new Gtk::Grid);
+        grid->set_row_spacing(10);
+        grid->set_column_spacing(5);
+        grid->set_border_width(5);
+        Gtk::Label *hint_label = Gtk::manage(new Gtk::Label("SSH Host:"));
+        hint_label->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_CENTER);
+        Gtk::Label *host_hint = Gtk::manage(new Gtk::Label(m_server_desc));
+        host_hint->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_CENTER);
+        Gtk::Label *label = Gtk::manage(new Gtk::Label("Password:"));
+        label->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_CENTER);
+        Gtk::Entry *password = Gtk::manage(new Gtk::Entry);
+        password->set_activates_default(true);
+        password->set_visibility(false);
+        Gtk::CheckButton *remember = Gtk::manage(new Gtk::CheckButton("_Remember password", true));
+        remember->set_active(settings.get_save_ssh_password());
+
+        grid->attach(*hint_label, 0, 0, 1, 1);
+        grid->attach(*host_hint, 1, 0, 1, 1);
+        grid->attach(*label, 0, 1, 1, 1);
+        grid->attach(*password, 1, 1, 1, 1);
+        grid->attach(*remember, 0, 2, 2, 1);
+
+        auto vbox = dialog.get_child();
+        dynamic_cast<Gtk::Container *>(vbox)->add(*grid);
+
+        CredentialStorage creds;
+        creds.got_ssh_password().connect([password, remember](const Glib::ustring &saved_password) {
+            if (!saved_password.empty()) {
+                password->set_text(saved_password);
+                password->select_region(0, saved_password.size());
+                remember->set_active(true);
+            }
+        });
+        creds.fetch_ssh_password(m_server_desc);
 
-    dialog.show_all();
-    int response = dialog.run();
-    dialog.hide();
+        dialog.show_all();
+        int response = dialog.run();
+        dialog.hide();
 
-    if (response != Gtk::RESPONSE_OK)
+        password_text = password->get_text();
+        remember_password = remember->get_active();
+        return response == Gtk::RESPONSE_OK;
+    });
+    if (!accepted)
         return false;
 
-    int result = ssh_userauth_password(m_ssh, nullptr, password->get_text().c_str());
+    if (!wait_for(SSH_AUTH_AGAIN, result, [this, &password_text]() {
+            return ssh_userauth_password(m_ssh, nullptr, password_text.c_str());
+        }))
+        return false;
     if (result != SSH_AUTH_SUCCESS) {
-        auto text = Glib::ustring::compose("Error connecting to %1: %2", m_hostname,
-                                           ssh_get_error(m_ssh));
-        Gtk::MessageDialog err_dialog(m_parent, text, false, Gtk::MESSAGE_ERROR);
-        (void)err_dialog.run();
+        show_error(Glib::ustring::compose("Error connecting to %1: %2", m_hostname,
+                                          ssh_get_error(m_ssh)));
         return false;
     }
 
-    if (remember->get_active())
-        CredentialStorage::remember_ssh_password(m_server_desc, password->get_text());
-    else
-        CredentialStorage::forget_ssh_password(m_server_desc);
-    settings.set_save_ssh_password(remember->get_active());
+    // Kept in memory only, so automatic reconnects don't need to prompt
+    m_saved_password_desc = m_server_desc;
+    m_saved_password = password_text;
+
+    post_ui([this, password_text, remember_password]() {
+        AppSettings settings;
+        if (remember_password)
+            CredentialStorage::remember_ssh_password(m_server_desc, password_text);
+        else
+            CredentialStorage::forget_ssh_password(m_server_desc);
+        settings.set_save_ssh_password(remember_password);
+    });
 
     return true;
 }
 
 bool SshTunnel::interactive()
 {
-    AppSettings settings;
+    // Keyboard-interactive usually means a one-time password
+    if (!m_interactive)
+        return false;
+
+    auto kbdint = [this]() { return ssh_userauth_kbdint(m_ssh, nullptr, nullptr); };
 
-    int result = ssh_userauth_kbdint(m_ssh, nullptr, nullptr);
+    int result;
+    if (!wait_for(SSH_AUTH_AGAIN, result, kbdint))
+        return false;
     while (result == SSH_AUTH_INFO) {
-        const char *name = ssh_userauth_kbdint_getname(m_ssh);
-        const char *instruction = ssh_userauth_kbdint_getinstruction(m_ssh);
+        // Copy everything the dialog needs, since the session belongs to
+        // this thread and the dialog runs on the main loop
+        auto to_string = [](const char *text) { return std::string(text ? text : ""); };
+        std::string name = to_string(ssh_userauth_kbdint_getname(m_ssh));
+        std::string instruction = to_string(ssh_userauth_kbdint_getinstruction(m_ssh));
         int nprompts = ssh_userauth_kbdint_getnprompts(m_ssh);
 
-        Gtk::Dialog dialog(name, m_parent);
-        dialog.add_button("_Cancel", Gtk::RESPONSE_CANCEL);
-        dialog.add_button("_Ok", Gtk::RESPONSE_OK);
-        dialog.set_default_response(Gtk::RESPONSE_OK);
-
-        auto *grid = Gtk::manage(new Gtk::Grid);
-        grid->set_row_spacing(10);
-        grid->set_column_spacing(5);
-        grid->set_border_width(5);
-
-        Gtk::Label *instruction_label = Gtk::manage(new Gtk::Label(instruction));
-        instruction_label->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_START);
-        grid->attach(*instruction_label, 0, 0, 2, 1);
-
+        std::vector<std::pair<std::string, bool>> prompts;
         for (int i = 0; i < nprompts; ++i) {
             char echo;
             const char *prompt = ssh_userauth_kbdint_getprompt(m_ssh, i, &echo);
-
-            Gtk::Label *prompt_label = Gtk::manage(new Gtk::Label(prompt));
-            prompt_label->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_START);
-
-            Gtk::Entry *input_entry = Gtk::manage(new Gtk::Entry);
-            input_entry->set_activates_default(true);
-            input_entry->set_visibility((bool)echo);
-
-            grid->attach(*prompt_label, 0, (i + 1), 1, 1);
-            grid->attach(*input_entry, 1, (i + 1), 1, 1);
+            prompts.emplace_back(to_string(prompt), (bool)echo);
         }
 
-        if (nprompts > 0 || (instruction && instruction[0])) {
-            auto vbox = dialog.get_child();
-            dynamic_cast<Gtk::Container *>(vbox)->add(*grid);
-            dialog.show_all();
-            int response = dialog.run();
-            dialog.hide();
+        std::vector<Glib::ustring> answers(nprompts);
+        if (nprompts > 0 || !instruction.empty()) {
+            bool accepted = call_ui<bool>([&]() {
+                Gtk::Dialog dialog(name, m_parent);
+                dialog.add_button("_Cancel", Gtk::RESPONSE_CANCEL);
+                dialog.add_button("_Ok", Gtk::RESPONSE_OK);
+                dialog.set_default_response(Gtk::RESPONSE_OK);
+
+                auto *grid = Gtk::manage(new Gtk::Grid);
+                grid->set_row_spacing(10);
+                grid->set_column_spacing(5);
+                grid->set_border_width(5);
+
+                Gtk::Label *instruction_label = Gtk::manage(new Gtk::Label(instruction));
+                instruction_label->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_START);
+                grid->attach(*instruction_label, 0, 0, 2, 1);
+
+                for (int i = 0; i < nprompts; ++i) {
+                    Gtk::Label *prompt_label = Gtk::manage(new Gtk::Label(prompts[i].first));
+                    prompt_label->set_alignment(Gtk::ALIGN_START, Gtk::ALIGN_START);
+
+                    Gtk::Entry *input_entry = Gtk::manage(new Gtk::Entry);
+                    input_entry->set_activates_default(true);
+                    input_entry->set_visibility(prompts[i].second);
+
+                    grid->attach(*prompt_label, 0, (i + 1), 1, 1);
+                    grid->attach(*input_entry, 1, (i + 1), 1, 1);
+                }
+
+                auto vbox = dialog.get_child();
+                dynamic_cast<Gtk::Container *>(vbox)->add(*grid);
+                dialog.show_all();
+                int response = dialog.run();
+                dialog.hide();
 
-            if (response != Gtk::RESPONSE_OK)
+                for (int i = 0; i < nprompts; ++i) {
+                    auto input_entry = dynamic_cast<Gtk::Entry*>(grid->get_child_at(1, i + 1));
+                    if (input_entry)
+                        answers[i] = input_entry->get_text();
+                }
+                return response == Gtk::RESPONSE_OK;
+            });
+            if (!accepted)
                 return false;
         }
 
-        for (int i = 0; i < nprompts; ++i) {
-            auto input_entry = dynamic_cast<Gtk::Entry*>(grid->get_child_at(1, i + 1));
-            if (input_entry) {
-                ssh_userauth_kbdint_setanswer(m_ssh, i, input_entry->get_text().c_str());
-            }
-        }
+        for (int i = 0; i < nprompts; ++i)
+            ssh_userauth_kbdint_setanswer(m_ssh, i, answers[i].c_str());
 
-        result = ssh_userauth_kbdint(m_ssh, nullptr, nullptr);
+        if (!wait_for(SSH_AUTH_AGAIN, result, kbdint))
+            return false;
     }
 
     if (result != SSH_AUTH_SUCCESS) {
-        auto text = Glib::ustring::compose("Error connecting to %1: %2", m_hostname,
-                                           ssh_get_error(m_ssh));
-        Gtk::MessageDialog err_dialog(m_parent, text, false, Gtk::MESSAGE_ERROR);
-        (void)err_dialog.run();
+        show_error(Glib::ustring::compose("Error connecting to %1: %2", m_hostname,
+                                          ssh_get_error(m_ssh)));
         return false;
     }
 
     return true;
 }
 
-struct ForwardClient
+// SOCKS5 (RFC 1928) handshake progress for clients of a dynamic forward
+enum SocksState
 {
+    SOCKS_DONE,
+    SOCKS_GREETING,
+    SOCKS_REQUEST,
+    SOCKS_CONNECTING,
+};
+
+struct SshTunnel::ForwardClient
+{
+    SshTunnel *m_tunnel;
+    std::shared_ptr<PortForward> m_forward;
     ssh_channel m_channel;
     Glib::RefPtr<Gio::Socket> m_socket;
-
-    ForwardClient() : m_channel() { }
+    struct ssh_channel_callbacks_struct m_callbacks;
+    std::string m_source_host;
+    int m_source_port;
+    SocksState m_socks_state;
+    std::shared_ptr<ChannelCounters> m_counters;
+
+    // Records what the local client receives, if enabled for forward_fd()
+    std::unique_ptr<RfbCapture> m_capture;
+
+    // Data read from the local socket, waiting to be written to the channel
+    RingBuffer m_to_remote;
+    // Data read from the channel, waiting to be written to the local socket
+    RingBuffer m_to_local;
+
+    // Bytes libssh is still holding for us because m_to_local was full
+    uint32_t m_remote_held;
+
+    // Data a window-growing read returned beyond what m_to_local could
+    // take.  It goes out before anything libssh is holding.
+    std::string m_spill;
+
+    // Repeats the non-blocking open request until the server replies
+    std::function<int (ssh_channel)> m_open;
+    std::string m_target;
+    bool m_opening;
+
+    // When the oldest unsent data in m_to_remote must go out, if the last
+    // read was a bulk one
+    std::chrono::steady_clock::time_point m_flush_deadline;
+    bool m_bulk;
+
+    // Receive window auto-tuning:  m_window is the window we advertised
+    // last (0 while libssh manages it), and m_window_used how much of it
+    // the server has used since.  While m_grow_window is set, channel_data()
+    // leaves a byte with libssh so fill_local() can advertise a new window.
+    std::chrono::steady_clock::time_point m_open_start;
+    std::chrono::steady_clock::time_point m_epoch_start;
+    uint64_t m_epoch_received;
+    uint64_t m_epoch_drained;
+    uint32_t m_window;
+    uint64_t m_window_used;
+    bool m_grow_window;
+
+    short m_events;
+    bool m_pending;
+    bool m_local_eof;
+    bool m_remote_eof;
+    bool m_closed;
+
+    explicit ForwardClient(SshTunnel *tunnel)
+        : m_tunnel(tunnel), m_channel(), m_callbacks(), m_source_port(),
+          m_socks_state(SOCKS_DONE), m_counters(std::make_shared<ChannelCounters>()),
+          m_to_remote(tunnel->m_buffer_pool, FORWARD_BUFFER_INITIAL, FORWARD_BUFFER_MAX),
+          m_to_local(tunnel->m_buffer_pool, FORWARD_BUFFER_INITIAL, FORWARD_BUFFER_MAX),
+          m_remote_held(), m_opening(false), m_bulk(false),
+          m_epoch_start(std::chrono::steady_clock::now()), m_epoch_received(), m_epoch_drained(),
+          m_window(), m_window_used(), m_grow_window(false), m_events(), m_pending(false), m_local_eof(false),
+          m_remote_eof(false), m_closed(false)
+    {
+        ssh_callbacks_init(&m_callbacks);
+        m_callbacks.userdata = this;
+        m_callbacks.channel_data_function = &ForwardClient::channel_data;
+        m_callbacks.channel_eof_function = &ForwardClient::channel_eof;
+        m_callbacks.channel_close_function = &ForwardClient::channel_close;
+    }
 
     ~ForwardClient()
     {
@@ -464,168 +1635,1018 @@ struct ForwardClient
             ssh_channel_free(m_channel);
     }
 
-    ForwardClient(ForwardClient &&src) noexcept
-        : m_channel(src.m_channel), m_socket(std::move(src.m_socket))
-    {
-        src.m_channel = nullptr;
-    }
-
-    ForwardClient &operator=(ForwardClient &&src) noexcept
-    {
-        m_channel = src.m_channel;
-        m_socket = std::move(src.m_socket);
-        src.m_channel = nullptr;
-        return *this;
-    }
-
     ForwardClient(const ForwardClient &) = delete;
     ForwardClient &operator=(const ForwardClient &) = delete;
+
+    bool read_local();
+    bool socks_handshake();
+    void socks_reply(unsigned char status);
+    bool flush_local();
+    size_t fill_local();
+    size_t grow_window();
+    void account_window(uint32_t received);
+    bool batch_ready(std::chrono::steady_clock::time_point now) const;
+    bool flush_remote();
+
+    static int channel_data(ssh_session, ssh_channel, void *data, uint32_t len,
+                            int is_stderr, void *userdata);
+    static void channel_eof(ssh_session, ssh_channel, void *userdata);
+    static void channel_close(ssh_session, ssh_channel, void *userdata);
+    static int socket_ready(socket_t fd, int revents, void *userdata);
 };
 
-void SshTunnel::tunnel_server(int ssh_fd)
+bool SshTunnel::ForwardClient::read_local()
 {
-    std::vector<ssh_channel> r_channels, w_channels;
-    std::vector<ForwardClient> clients;
-    fd_set rfds;
-    struct timeval timeout{};
-    int server_fd = m_forward_socket->get_fd();
-    char buffer[FORWARD_BUFFER_SIZE];
+    size_t len;
+    char *bufp = m_to_remote.write_ptr(len);
+    if (len == 0)
+        return true;
 
-    for ( ;; ) {
-        FD_ZERO(&rfds);
-        FD_SET(ssh_fd, &rfds);
-        if (server_fd)
-            FD_SET(server_fd, &rfds);
-        int maxfd = std::max(ssh_fd, server_fd) + 1;
-        r_channels.resize(clients.size() + 1);
-        w_channels.resize(clients.size() + 1);
-        for (size_t i = 0; i < clients.size(); ++i) {
-            r_channels[i] = clients[i].m_channel;
-            w_channels[i] = nullptr;
-            int fd = clients[i].m_socket->get_fd();
-            FD_SET(fd, &rfds);
-            maxfd = std::max(maxfd, fd + 1);
-        }
-        r_channels[clients.size()] = nullptr;
-        w_channels[clients.size()] = nullptr;
-
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 200000;
-        int result = ssh_select(r_channels.data(), w_channels.data(),
-                                maxfd, &rfds, &timeout);
-        if (m_eof)
-            return;
-        if (result == EINTR || result == SSH_EINTR)
-            continue;
+    gssize in_size;
+    try {
+        ScopeTimer timer(m_tunnel->m_local_io_usec);
+        in_size = m_socket->receive(bufp, len);
+    } catch (Gio::Error &err) {
+        if (err.code() == Gio::Error::WOULD_BLOCK)
+            return true;
+        std::cerr << "Error reading from local socket: "
+                  << err.what() << std::endl;
+        return false;
+    }
+    if (in_size == 0) {
+        m_local_eof = true;
+        return true;
+    }
 
-        if (FD_ISSET(server_fd, &rfds)) {
-            ForwardClient client;
-            try {
-                client.m_socket = m_forward_socket->accept();
-            } catch (Gio::Error &err) {
-                std::cerr << "Error accepting forward socket: "
-                          << err.what() << std::endl;
-                continue;
-            }
-            client.m_channel = ssh_channel_new(m_ssh);
-            if (!client.m_channel) {
-                std::cerr << "Error creating forwarding channel: "
-                          << ssh_get_error(m_ssh) << std::endl;
-                continue;
+    if (m_to_remote.empty())
+        m_flush_deadline = std::chrono::steady_clock::now() + FORWARD_COALESCE_DELAY;
+    m_bulk = (in_size >= FORWARD_COALESCE_BULK);
+    if (m_capture)
+        m_capture->client_data(bufp, in_size);
+    m_to_remote.commit(in_size);
+    add_counter(m_tunnel->m_local_reads, 1);
+    return true;
+}
+
+bool SshTunnel::ForwardClient::socks_handshake()
+{
+    // Large enough for the longest possible greeting or request
+    unsigned char buffer[262];
+
+    if (m_socks_state == SOCKS_GREETING) {
+        size_t avail = m_to_remote.peek(buffer, sizeof(buffer));
+        if (avail < 2)
+            return true;
+        if (buffer[0] != 5) {
+            std::cerr << "Unsupported SOCKS version " << int(buffer[0]) << std::endl;
+            return false;
+        }
+        size_t len = 2 + buffer[1];
+        if (avail < len)
+            return true;
+        m_to_remote.consume(len);
+
+        // We only offer "no authentication"; the socket is only accessible
+        // to our own user
+        unsigned char *methods_end = buffer + len;
+        bool no_auth = std::find(buffer + 2, methods_end, 0x00) != methods_end;
+        const unsigned char reply[] = { 5, static_cast<unsigned char>(no_auth ? 0x00 : 0xFF) };
+        m_to_local.write(reply, sizeof(reply));
+        if (!no_auth) {
+            flush_local();
+            return false;
+        }
+        m_socks_state = SOCKS_REQUEST;
+    }
+
+    if (m_socks_state == SOCKS_REQUEST) {
+        size_t avail = m_to_remote.peek(buffer, sizeof(buffer));
+        if (avail < 5)
+            return true;
+        if (buffer[0] != 5) {
+            std::cerr << "Unsupported SOCKS version " << int(buffer[0]) << std::endl;
+            return false;
+        }
+
+        size_t addr_len;
+        switch (buffer[3]) {
+        case 1:     // IPv4
+            addr_len = 4;
+            break;
+        case 3:     // Domain name
+            addr_len = 1 + buffer[4];
+            break;
+        case 4:     // IPv6
+            addr_len = 16;
+            break;
+        default:
+            socks_reply(0x08);
+            return false;
+        }
+        size_t len = 4 + addr_len + 2;
+        if (avail < len)
+            return true;
+        m_to_remote.consume(len);
+
+        if (buffer[1] != 1) {
+            // Only CONNECT is supported
+            socks_reply(0x07);
+            return false;
+        }
+
+        std::string host;
+        if (buffer[3] == 3) {
+            host.assign(reinterpret_cast<const char *>(buffer + 5), buffer[4]);
+        } else {
+            auto family = (buffer[3] == 1) ? Gio::SOCKET_FAMILY_IPV4 : Gio::SOCKET_FAMILY_IPV6;
+            host = Gio::InetAddress::create_from_bytes(buffer + 4, family)->to_string();
+        }
+        int port = (buffer[len - 2] << 8) | buffer[len - 1];
+
+        if (!m_tunnel->open_tcp_channel(this, host, port)) {
+            socks_reply(0x05);
+            return false;
+        }
+
+        // Otherwise, the reply is sent by finish_opening()
+        m_socks_state = SOCKS_CONNECTING;
+        if (!m_opening) {
+            socks_reply(0x00);
+            m_socks_state = SOCKS_DONE;
+        }
+    }
+
+    return true;
+}
+
+void SshTunnel::ForwardClient::socks_reply(unsigned char status)
+{
+    // We don't report the bound address, since it's meaningless here
+    const unsigned char reply[] = { 5, status, 0, 1, 0, 0, 0, 0, 0, 0 };
+    m_to_local.write(reply, sizeof(reply));
+    if (status != 0x00)
+        flush_local();
+}
+
+bool SshTunnel::ForwardClient::flush_local()
+{
+    while (!m_to_local.empty()) {
+        size_t len;
+        const char *bufp = m_to_local.read_ptr(len);
+        gssize out_size;
+        try {
+            ScopeTimer timer(m_tunnel->m_local_io_usec);
+            out_size = m_socket->send(bufp, len);
+        } catch (Gio::Error &err) {
+            if (err.code() == Gio::Error::WOULD_BLOCK) {
+                add_counter(m_counters->downstream_stalls, 1);
+                add_counter(m_tunnel->m_downstream_stalls, 1);
+                break;
             }
+            std::cerr << "Error writing to local socket: "
+                      << err.what() << std::endl;
+            return false;
+        }
+        if (m_capture)
+            m_capture->server_data(bufp, out_size);
+        m_to_local.consume(out_size);
+        m_epoch_drained += out_size;
+        add_counter(m_counters->downstream_bytes, out_size);
+        add_counter(m_tunnel->m_downstream_bytes, out_size);
+    }
+    return true;
+}
 
-            auto local_address = Glib::RefPtr<Gio::InetSocketAddress>::cast_dynamic(m_forward_socket->get_local_address());
-            if (ssh_channel_open_forward(client.m_channel, m_remote_host.c_str(), m_remote_port,
-                                         local_address->get_address()->to_string().c_str(),
-                                         local_address->get_port()) != SSH_OK) {
-                std::cerr << "Error opening forwarding channel: "
-                          << ssh_get_error(m_ssh) << std::endl;
-                continue;
+size_t SshTunnel::ForwardClient::fill_local()
+{
+    size_t filled = 0;
+    if (!m_spill.empty()) {
+        filled = m_to_local.write(m_spill.data(), m_spill.size());
+        m_spill.erase(0, filled);
+        if (!m_spill.empty())
+            return filled;
+    }
+
+    // Only ask for data we know libssh already has buffered, so this never
+    // has to go back to the network (and re-enter our callbacks).
+    if (m_remote_held == 0)
+        return filled;
+
+    size_t len;
+    char *bufp = m_to_local.write_ptr(len);
+    len = std::min<size_t>(len, m_remote_held);
+    if (len == 0)
+        return filled;
+
+    ScopeTimer timer(m_tunnel->m_ssh_usec);
+    if (m_grow_window && len == m_remote_held)
+        return filled + grow_window();
+
+    int in_size = ssh_channel_read_nonblocking(m_channel, bufp, len, 0);
+    if (in_size <= 0) {
+        m_remote_held = 0;
+        return filled;
+    }
+    m_to_local.commit(in_size);
+    m_remote_held -= in_size;
+    return filled + in_size;
+}
+
+size_t SshTunnel::ForwardClient::grow_window()
+{
+    // Asking for more than libssh has buffered plus the current window
+    // makes it advertise a window of the difference, which is the only way
+    // to size it through the public API.  That read may poll the socket,
+    // and channel_data() may run meanwhile, so it doesn't get to write into
+    // m_to_local directly.  Untouched pages of the scratch buffer are never
+    // actually allocated.
+    m_grow_window = false;
+    const size_t count = static_cast<size_t>(m_remote_held) + m_window;
+    std::unique_ptr<char[]> scratch(new char[count]);
+    int in_size = ssh_channel_read_timeout(m_channel, scratch.get(), count, 0, 0);
+    m_window_used = 0;
+    if (in_size <= 0) {
+        m_remote_held = 0;
+        return 0;
+    }
+
+    // If channel_data() ran, it took what it could from the front of
+    // libssh's buffer and updated m_remote_held, so this still comes after
+    m_remote_held -= std::min<uint32_t>(m_remote_held, in_size);
+    size_t written = m_to_local.write(scratch.get(), in_size);
+    m_spill.assign(scratch.get() + written, in_size - written);
+    return written;
+}
+
+bool SshTunnel::ForwardClient::batch_ready(std::chrono::steady_clock::time_point now) const
+{
+    return !m_bulk || m_local_eof || m_to_remote.size() >= FORWARD_COALESCE_PACKET
+           || now >= m_flush_deadline;
+}
+
+bool SshTunnel::ForwardClient::flush_remote()
+{
+    while (!m_to_remote.empty()) {
+        size_t len;
+        const char *bufp = m_to_remote.read_ptr(len);
+        int out_size;
+        {
+            ScopeTimer timer(m_tunnel->m_ssh_usec);
+            out_size = ssh_channel_write(m_channel, bufp, len);
+        }
+        if (out_size < 0) {
+            std::cerr << "Error writing to SSH channel: "
+                      << ssh_get_error(m_tunnel->m_ssh) << std::endl;
+            return false;
+        }
+        if (out_size == 0) {
+            // The remote window is full -- try again after the next poll
+            add_counter(m_counters->upstream_stalls, 1);
+            add_counter(m_tunnel->m_upstream_stalls, 1);
+            break;
+        }
+        m_to_remote.consume(out_size);
+        add_counter(m_counters->upstream_bytes, out_size);
+        add_counter(m_tunnel->m_channel_writes, 1);
+        add_counter(m_tunnel->m_upstream_bytes, out_size);
+    }
+    return true;
+}
+
+int SshTunnel::ForwardClient::channel_data(ssh_session, ssh_channel, void *data,
+                                           uint32_t len, int is_stderr, void *userdata)
+{
+    auto self = reinterpret_cast<ForwardClient *>(userdata);
+    if (self->m_closed)
+        return static_cast<int>(len);
+    if (is_stderr) {
+        // Diagnostics from an exec channel's command; keep them out of the stream
+        std::cerr.write(reinterpret_cast<const char *>(data), len);
+        return static_cast<int>(len);
+    }
+
+    // libssh passes what we held back last time along with the new data
+    self->account_window(len - std::min(len, self->m_remote_held));
+
+    if (self->m_socks_state != SOCKS_DONE || !self->m_spill.empty()) {
+        // Hold on to this until the SOCKS reply has been queued, or until
+        // the spilled data ahead of it is out
+        self->m_remote_held = len;
+        return 0;
+    }
+
+    // Anything we don't consume stays in the channel's buffer, and counts
+    // against the window we advertise to the server.
+    size_t wanted = self->m_grow_window ? len - 1 : len;
+    size_t written = self->m_to_local.write(data, wanted);
+    self->m_remote_held = len - written;
+    self->m_tunnel->queue_client(self);
+    return static_cast<int>(written);
+}
+
+void SshTunnel::ForwardClient::account_window(uint32_t received)
+{
+    const uint32_t max_window = m_tunnel->m_max_window;
+    if (max_window < WINDOW_TUNING_MIN)
+        return;
+
+    m_window_used += received;
+    m_epoch_received += received;
+
+    auto now = std::chrono::steady_clock::now();
+    auto rtt = std::chrono::microseconds(m_tunnel->m_rtt_usec.load());
+    if (rtt.count() == 0)
+        rtt = WINDOW_DEFAULT_RTT;
+    if (now - m_epoch_start >= rtt) {
+        // Receiving most of a window per round trip means the server spent
+        // part of it waiting for window adjustments.  Only grow the window
+        // while the local side keeps up, or it would just fill our buffers.
+        const uint32_t window = m_window ? m_window : LIBSSH_WINDOW_DEFAULT;
+        if (m_epoch_received >= window / 4 * 3
+                && m_epoch_drained >= m_epoch_received / 10 * 9) {
+            add_counter(m_tunnel->m_window_stalls, 1);
+            uint32_t target = std::min<uint64_t>(static_cast<uint64_t>(window) * 2, max_window);
+            if (target >= WINDOW_TUNING_MIN && target > m_window) {
+                m_window = target;
+                m_grow_window = true;
+                m_counters->window_size.store(target, std::memory_order_relaxed);
+                m_tunnel->m_window_size.store(target, std::memory_order_relaxed);
             }
-            clients.emplace_back(std::move(client));
+        }
+        m_epoch_start = now;
+        m_epoch_received = 0;
+        m_epoch_drained = 0;
+    }
+
+    // Top the window back up before libssh's own refill would kick in
+    if (m_window && m_window_used >= m_window / 2)
+        m_grow_window = true;
+}
+
+void SshTunnel::ForwardClient::channel_eof(ssh_session, ssh_channel, void *userdata)
+{
+    auto self = reinterpret_cast<ForwardClient *>(userdata);
+    self->m_remote_eof = true;
+    self->m_tunnel->queue_client(self);
+}
+
+void SshTunnel::ForwardClient::channel_close(ssh_session, ssh_channel, void *userdata)
+{
+    auto self = reinterpret_cast<ForwardClient *>(userdata);
+    self->m_remote_eof = true;
+    self->m_tunnel->queue_client(self);
+}
+
+int SshTunnel::ForwardClient::socket_ready(socket_t, int revents, void *userdata)
+{
+    auto self = reinterpret_cast<ForwardClient *>(userdata);
+    if (self->m_closed)
+        return SSH_OK;
+
+    if ((revents & (POLLIN | POLLHUP | POLLERR)) && !self->m_local_eof) {
+        if (!self->read_local()) {
+            self->m_tunnel->close_client(self);
+            return SSH_OK;
+        }
+    }
+    self->m_tunnel->queue_client(self);
+    return SSH_OK;
+}
+
+int SshTunnel::listener_ready(socket_t, int, void *userdata)
+{
+    auto forward = reinterpret_cast<PortForward *>(userdata);
+    forward->m_tunnel->accept_client(forward);
+    return SSH_OK;
+}
+
+void SshTunnel::start_listener(const std::shared_ptr<PortForward> &forward)
+{
+    if (ssh_event_add_fd(m_event, forward->m_listener->get_fd(), POLLIN,
+                         &SshTunnel::listener_ready, forward.get()) != SSH_OK) {
+        std::cerr << "Error adding forward listener to event loop" << std::endl;
+        return;
+    }
+    m_listeners.push_back(forward);
+}
+
+void SshTunnel::accept_client(PortForward *forward)
+{
+    Glib::RefPtr<Gio::Socket> socket;
+    try {
+        socket = forward->m_listener->accept();
+    } catch (Gio::Error &err) {
+        std::cerr << "Error accepting forward socket: "
+                  << err.what() << std::endl;
+        return;
+    }
+
+    // The originator reported to the server; the Unix socket of a SOCKS
+    // proxy has no address of its own
+    std::string source_host = "127.0.0.1";
+    int source_port = 0;
+    auto local_address = Glib::RefPtr<Gio::InetSocketAddress>::cast_dynamic(forward->m_listener->get_local_address());
+    if (local_address) {
+        source_host = local_address->get_address()->to_string();
+        source_port = local_address->get_port();
+    }
+
+    // Spread the connections of a striped tunnel across its sessions.  The
+    // other sessions' forward threads take over the socket, along with a
+    // copy of the forward they can use without sharing it with us.
+    SshTunnel *stripe = next_stripe();
+    if (stripe != this) {
+        auto copy = forward->copy_for(stripe);
+        stripe->post_command([stripe, socket, copy, source_host, source_port]() {
+            stripe->add_client(socket, copy, source_host, source_port);
+        });
+        return;
+    }
+    add_client(socket, forward->shared_from_this(), source_host, source_port);
+}
+
+void SshTunnel::add_client(const Glib::RefPtr<Gio::Socket> &socket,
+                           const std::shared_ptr<PortForward> &forward,
+                           const std::string &source_host, int source_port)
+{
+    if (m_spare && m_spare->m_remote_eof)
+        discard_spare();
+
+    std::unique_ptr<ForwardClient> client;
+    const bool use_spare = m_spare && m_spare_key == forward->spare_key();
+    if (use_spare) {
+        // The channel was opened ahead of time, and anything the server has
+        // already sent (like the RFB greeting) is waiting in its buffer
+        client = std::move(m_spare);
+    } else {
+        client = std::make_unique<ForwardClient>(this);
+    }
+    client->m_forward = forward;
+    client->m_socket = socket;
+    client->m_source_host = source_host;
+    client->m_source_port = source_port;
+    client->m_capture = std::move(forward->m_capture);
+
+    if (use_spare) {
+        // Nothing to open
+    } else if (forward->is_dynamic()) {
+        // The channel is opened once the client tells us where it's going
+        client->m_socks_state = SOCKS_GREETING;
+    } else if (!open_channel(client.get())) {
+        return;
+    }
+
+    // Local sockets only ever talk to loopback or a socket pair, so fixed
+    // buffers are fine, and keep bursts from piling up in the kernel
+    client->m_socket->set_blocking(false);
+    int fd = client->m_socket->get_fd();
+    set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, FORWARD_SOCKET_BUFFER);
+    set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, FORWARD_SOCKET_BUFFER);
+    if (client->m_socket->get_family() != Gio::SOCKET_FAMILY_UNIX)
+        set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    forward->m_clients.insert(client.get());
+    if (forward->is_dynamic())
+        client->m_counters->target = "socks";
+    else if (!forward->m_remote_command.empty())
+        client->m_counters->target = "exec:" + forward->m_remote_command;
+    else if (!forward->m_remote_path.empty())
+        client->m_counters->target = "unix:" + forward->m_remote_path;
+    else
+        client->m_counters->target = forward->m_remote_host + ":" + std::to_string(forward->m_remote_port);
+    auto iter = m_clients.emplace(fd, std::move(client)).first;
+    publish_channels();
+
+    // Registering with the event loop is deferred until the client is
+    // serviced, since the fd set can't be modified during a poll
+    queue_client(iter->second.get());
+}
+
+void SshTunnel::open_spare(const std::shared_ptr<PortForward> &forward)
+{
+    auto key = forward->spare_key();
+    if (!m_use_spare || key.empty() || (m_spare && m_spare_key == key))
+        return;
+
+    discard_spare();
+    auto spare = std::make_unique<ForwardClient>(this);
+    spare->m_forward = forward;
+    spare->m_source_host = "127.0.0.1";
+    if (!open_channel(spare.get()))
+        return;
+    m_spare = std::move(spare);
+    m_spare_key = key;
+}
+
+void SshTunnel::discard_spare()
+{
+    if (!m_spare)
+        return;
+    if (m_spare->m_opening) {
+        m_opening_clients.erase(std::find(m_opening_clients.begin(),
+                                          m_opening_clients.end(), m_spare.get()));
+    }
+    m_spare.reset();
+    m_spare_key.clear();
+}
+
+bool SshTunnel::open_channel(ForwardClient *client)
+{
+    // The request is repeated until it completes, possibly after the client
+    // has switched to another forward, so capture everything by value
+    const PortForward &forward = *client->m_forward;
+    const std::string source_host = client->m_source_host;
+    const int source_port = client->m_source_port;
+    if (!forward.m_remote_command.empty()) {
+        const std::string command = forward.m_remote_command;
+        return open_channel(client, command, [command](ssh_channel channel) {
+            int result = ssh_channel_open_session(channel);
+            if (result == SSH_OK)
+                result = ssh_channel_request_exec(channel, command.c_str());
+            return result;
+        });
+    }
+    if (!forward.m_remote_path.empty()) {
+        // direct-streamlocal@openssh.com, so the server connects to its own
+        // Unix socket and no relay is needed on the remote side
+        const std::string path = forward.m_remote_path;
+        return open_channel(client, path, [path, source_host, source_port](ssh_channel channel) {
+            return ssh_channel_open_forward_unix(channel, path.c_str(), source_host.c_str(),
+                                                 source_port);
+        });
+    }
+    return open_tcp_channel(client, forward.m_remote_host, forward.m_remote_port);
+}
+
+bool SshTunnel::open_tcp_channel(ForwardClient *client, const std::string &remote_host,
+                                 int remote_port)
+{
+    auto target = remote_host + ":" + std::to_string(remote_port);
+    const std::string source_host = client->m_source_host;
+    const int source_port = client->m_source_port;
+    return open_channel(client, target,
+                        [remote_host, remote_port, source_host, source_port](ssh_channel channel) {
+        return ssh_channel_open_forward(channel, remote_host.c_str(), remote_port,
+                                        source_host.c_str(), source_port);
+    });
+}
+
+bool SshTunnel::open_channel(ForwardClient *client, const std::string &target,
+                             std::function<int (ssh_channel)> open)
+{
+    client->m_channel = ssh_channel_new(m_ssh);
+    if (!client->m_channel) {
+        std::cerr << "Error creating forwarding channel: "
+                  << ssh_get_error(m_ssh) << std::endl;
+        return false;
+    }
+
+    // Install the callbacks before opening the channel, so data sent by the
+    // server along with the open confirmation is not left in libssh's buffer
+    ssh_set_channel_callbacks(client->m_channel, &client->m_callbacks);
+
+    // The session is non-blocking, so this normally just sends the request.
+    // finish_opening() picks up the reply, and other clients keep flowing
+    // during the round trip.
+    int result = open(client->m_channel);
+    if (result == SSH_AGAIN) {
+        client->m_open = std::move(open);
+        client->m_target = target;
+        client->m_opening = true;
+        client->m_open_start = std::chrono::steady_clock::now();
+        m_opening_clients.push_back(client);
+        return true;
+    }
+    if (result != SSH_OK) {
+        std::cerr << "Error opening forwarding channel to " << target
+                  << ": " << ssh_get_error(m_ssh) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void SshTunnel::finish_opening()
+{
+    if (m_opening_clients.empty())
+        return;
+
+    auto opening = std::move(m_opening_clients);
+    m_opening_clients.clear();
+    for (ForwardClient *client : opening) {
+        int result = client->m_open(client->m_channel);
+        if (result == SSH_AGAIN) {
+            m_opening_clients.push_back(client);
             continue;
         }
 
-        auto client = clients.begin();
-        while (client != clients.end()) {
-            if (!FD_ISSET(client->m_socket->get_fd(), &rfds)) {
-                ++client;
+        client->m_opening = false;
+        client->m_open = nullptr;
+        if (result != SSH_OK) {
+            std::cerr << "Error opening forwarding channel to " << client->m_target
+                      << ": " << ssh_get_error(m_ssh) << std::endl;
+            if (client == m_spare.get()) {
+                m_spare.reset();
+                m_spare_key.clear();
                 continue;
             }
+            if (client->m_socks_state == SOCKS_CONNECTING)
+                client->socks_reply(0x05);
+            close_client(client);
+            continue;
+        }
 
-            gssize in_size;
-            try {
-                in_size = client->m_socket->receive(buffer, FORWARD_BUFFER_SIZE);
-            } catch (Gio::Error &err) {
-                std::cerr << "Error reading from local socket: "
-                          << err.what() << std::endl;
-                client = clients.erase(client);
-                break;
-            }
-            if (in_size == 0) {
-                ssh_channel_send_eof(client->m_channel);
-                client = clients.erase(client);
+        // An open is a single round trip to the server (plus a connect on
+        // its side), so the fastest one is a good estimate of the RTT
+        auto rtt = std::max<uint64_t>(usec_since(client->m_open_start), 1);
+        if (m_rtt_usec == 0 || rtt < m_rtt_usec)
+            m_rtt_usec = static_cast<uint32_t>(rtt);
+        client->m_counters->open_usec.store(static_cast<uint32_t>(rtt), std::memory_order_relaxed);
+        add_counter(m_channels_opened, 1);
+        add_counter(m_open_usec_total, rtt);
+
+        if (client->m_socks_state == SOCKS_CONNECTING) {
+            client->socks_reply(0x00);
+            client->m_socks_state = SOCKS_DONE;
+        }
+        queue_client(client);
+    }
+}
+
+void SshTunnel::queue_client(ForwardClient *client)
+{
+    // The spare channel has no socket, and just buffers until it's used
+    if (client->m_pending || !client->m_socket)
+        return;
+    client->m_pending = true;
+    m_pending_clients.push_back(client);
+}
+
+void SshTunnel::service_clients()
+{
+    std::vector<ForwardClient *> blocked;
+    while (!m_pending_clients.empty()) {
+        auto pending = std::move(m_pending_clients);
+        m_pending_clients.clear();
+
+        // Client-to-server data goes out first:  Keyboard and pointer events
+        // are tiny, and shouldn't wait behind framebuffer data for anyone.
+        auto now = std::chrono::steady_clock::now();
+        for (ForwardClient *client : pending) {
+            if (client->m_closed || client->m_opening || client->m_socks_state != SOCKS_DONE)
                 continue;
-            }
+            if (client->batch_ready(now) && !client->flush_remote())
+                close_client(client);
+        }
 
-            char *bufp = buffer;
-            while (in_size) {
-                int out_size = ssh_channel_write(client->m_channel, bufp, in_size);
-                if (out_size < 0) {
-                    std::cerr << "Error writing to SSH channel: "
-                              << ssh_get_error(m_ssh) << std::endl;
-                    ssh_channel_close(client->m_channel);
-                    break;
-                }
-                in_size -= out_size;
-                bufp += out_size;
+        for (ForwardClient *client : pending) {
+            client->m_pending = false;
+            service_client(client);
+            if (!client->m_closed && !client->m_to_remote.empty())
+                blocked.push_back(client);
+        }
+    }
+
+    // Clients waiting on the remote window get another try after the next
+    // poll, which will wake up when the server adjusts the window.
+    for (ForwardClient *client : blocked)
+        queue_client(client);
+
+    // Clients that used up their slice continue after a poll that doesn't
+    // wait, so any input that arrived in the meantime is sent first
+    m_downstream_backlog = !m_backlog_clients.empty();
+    for (ForwardClient *client : m_backlog_clients)
+        queue_client(client);
+    m_backlog_clients.clear();
+
+    // Held batches get another look when the first of them is due, unless
+    // more data for them wakes the poll up earlier
+    m_holding_batches = !m_coalescing_clients.empty();
+    for (ForwardClient *client : m_coalescing_clients) {
+        if (client == m_coalescing_clients.front() || client->m_flush_deadline < m_batch_deadline)
+            m_batch_deadline = client->m_flush_deadline;
+        queue_client(client);
+    }
+    m_coalescing_clients.clear();
+}
+
+void SshTunnel::service_client(ForwardClient *client)
+{
+    if (client->m_closed)
+        return;
+
+    if (client->m_socks_state != SOCKS_DONE) {
+        if (!client->socks_handshake()) {
+            close_client(client);
+            return;
+        }
+        if (client->m_socks_state != SOCKS_DONE) {
+            if (client->m_local_eof || !client->flush_local()) {
+                close_client(client);
+                return;
             }
-            if (ssh_channel_is_closed(client->m_channel))
-                client = clients.erase(client);
-            else
-                ++client;
+            update_events(client);
+            return;
         }
+    }
+
+    if (client->m_opening) {
+        // Keep buffering local data until the server confirms the channel
+        update_events(client);
+        return;
+    }
 
-        client = clients.begin();
-        while (client != clients.end()) {
-            if (std::find(w_channels.begin(), w_channels.end(), client->m_channel) == w_channels.end()) {
-                ++client;
+    if (!client->batch_ready(std::chrono::steady_clock::now())) {
+        m_coalescing_clients.push_back(client);
+    } else if (!client->flush_remote()) {
+        close_client(client);
+        return;
+    }
+
+    size_t moved = 0;
+    for (;;) {
+        if (!client->flush_local()) {
+            close_client(client);
+            return;
+        }
+        if (moved >= FORWARD_DOWNSTREAM_SLICE) {
+            // Only if the local socket took everything; otherwise there's
+            // nothing to do until it's writable again
+            if ((client->m_remote_held > 0 || !client->m_spill.empty())
+                    && client->m_to_local.empty())
+                m_backlog_clients.push_back(client);
+            break;
+        }
+        size_t in_size = client->fill_local();
+        if (in_size == 0)
+            break;
+        moved += in_size;
+    }
+
+    if (client->m_local_eof && client->m_to_remote.empty()) {
+        ssh_channel_send_eof(client->m_channel);
+        close_client(client);
+        return;
+    }
+    if (client->m_remote_eof && client->m_to_local.empty() && client->m_remote_held == 0
+            && client->m_spill.empty()) {
+        close_client(client);
+        return;
+    }
+
+    update_events(client);
+}
+
+void SshTunnel::update_events(ForwardClient *client)
+{
+    // Stop reading from a source while the buffer it feeds is full, and only
+    // wait for the local socket to become writable when we have data for it
+    short events = 0;
+    if (!client->m_local_eof && !client->m_to_remote.full())
+        events |= POLLIN;
+    if (!client->m_to_local.empty())
+        events |= POLLOUT;
+    if (events == client->m_events)
+        return;
+
+    int fd = client->m_socket->get_fd();
+    if (client->m_events)
+        ssh_event_remove_fd(m_event, fd);
+    client->m_events = events;
+    if (events && ssh_event_add_fd(m_event, fd, events, &ForwardClient::socket_ready,
+                                   client) != SSH_OK) {
+        std::cerr << "Error adding forward socket to event loop" << std::endl;
+        client->m_events = 0;
+        close_client(client);
+    }
+}
+
+void SshTunnel::close_client(ForwardClient *client)
+{
+    // Clients are only removed once the event loop is no longer dispatching
+    // to them, since libssh may still be holding the channel or fd callback.
+    if (client->m_closed)
+        return;
+    client->m_closed = true;
+    m_closed_clients.push_back(client->m_socket->get_fd());
+}
+
+void SshTunnel::reap_clients()
+{
+    // Freeing a channel can flush the session and dispatch callbacks for
+    // other clients, so never destroy a client while it's still in the table.
+    bool reaped = false;
+    while (!m_closed_clients.empty()) {
+        auto closed = std::move(m_closed_clients);
+        m_closed_clients.clear();
+        for (int fd : closed) {
+            auto iter = m_clients.find(fd);
+            if (iter == m_clients.end())
                 continue;
+            auto client = std::move(iter->second);
+            m_clients.erase(iter);
+            client->m_forward->m_clients.erase(client.get());
+            if (client->m_events)
+                ssh_event_remove_fd(m_event, fd);
+            if (client->m_pending) {
+                m_pending_clients.erase(std::find(m_pending_clients.begin(),
+                                                  m_pending_clients.end(),
+                                                  client.get()));
             }
+            if (client->m_opening) {
+                m_opening_clients.erase(std::find(m_opening_clients.begin(),
+                                                  m_opening_clients.end(),
+                                                  client.get()));
+            }
+            client.reset();
+            reaped = true;
+        }
+    }
+    if (reaped)
+        publish_channels();
+}
 
-            for (int is_stderr : {0, 1}) {
-                while (ssh_channel_is_open(client->m_channel)
-                       && ssh_channel_poll(client->m_channel, is_stderr)) {
-                    int in_size = ssh_channel_read(client->m_channel, buffer,
-                                                   FORWARD_BUFFER_SIZE, 0);
-                    if (in_size < 0) {
-                        std::cerr << "Error reading from SSH channel: "
-                                  << ssh_get_error(m_ssh) << std::endl;
-                        ssh_channel_close(client->m_channel);
-                        continue;
-                    }
-                    if (in_size == 0)
-                        ssh_channel_close(client->m_channel);
-                    gchar *bufp = buffer;
-                    while (in_size) {
-                        gssize out_size;
-                        try {
-                            out_size = client->m_socket->send(bufp, in_size);
-                        } catch (Gio::Error &err) {
-                            std::cerr << "Error writing to local socket: "
-                                      << err.what() << std::endl;
-                            ssh_channel_close(client->m_channel);
-                            continue;
-                        }
-                        in_size -= out_size;
-                        bufp += out_size;
-                    }
-                }
+void SshTunnel::publish_channels()
+{
+    auto channels = std::make_shared<ChannelList>();
+    channels->reserve(m_clients.size());
+    for (const auto &client : m_clients)
+        channels->push_back(client.second->m_counters);
+    std::atomic_store(&m_channel_list, std::shared_ptr<const ChannelList>(std::move(channels)));
+}
+
+void SshTunnel::update_rates(std::chrono::steady_clock::time_point now)
+{
+    std::chrono::duration<double> elapsed = now - m_rates_time;
+    if (elapsed < STATS_RATE_INTERVAL)
+        return;
+
+    uint64_t upstream = m_upstream_bytes.load(std::memory_order_relaxed);
+    uint64_t downstream = m_downstream_bytes.load(std::memory_order_relaxed);
+    m_upstream_rate.store((upstream - m_rates_upstream) / elapsed.count(),
+                          std::memory_order_relaxed);
+    m_downstream_rate.store((downstream - m_rates_downstream) / elapsed.count(),
+                            std::memory_order_relaxed);
+    m_rates_time = now;
+    m_rates_upstream = upstream;
+    m_rates_downstream = downstream;
+
+#if !defined(_WIN32) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec cpu_time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time) == 0) {
+        m_cpu_usec.store(static_cast<uint64_t>(cpu_time.tv_sec) * 1000000
+                         + cpu_time.tv_nsec / 1000, std::memory_order_relaxed);
+    }
+#endif
+}
+
+void SshTunnel::post_command(std::function<void ()> command)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_command_lock);
+        m_commands.emplace_back(std::move(command));
+    }
+    wakeup();
+}
+
+void SshTunnel::wakeup()
+{
+    const char signal = 0;
+    try {
+        m_wakeup_write->send(&signal, 1);
+    } catch (Gio::Error &) {
+        /* Already full -- the forward thread has a wakeup pending */
+    }
+}
+
+int SshTunnel::wakeup_ready(socket_t, int, void *userdata)
+{
+    auto self = reinterpret_cast<SshTunnel *>(userdata);
+    char buffer[64];
+    try {
+        while (self->m_wakeup_read->receive(buffer, sizeof(buffer)) > 0) {
+            /* Drain all pending wakeups */
+        }
+    } catch (Gio::Error &) {
+        /* Nothing left to read */
+    }
+    return SSH_OK;
+}
+
+void SshTunnel::run_commands()
+{
+    std::vector<std::function<void ()>> commands;
+    {
+        std::lock_guard<std::mutex> guard(m_command_lock);
+        commands.swap(m_commands);
+    }
+    for (const auto &command : commands)
+        command();
+}
+
+void SshTunnel::tunnel_server()
+{
+    m_event = ssh_event_new();
+    if (!m_event) {
+        std::cerr << "Error creating SSH event loop" << std::endl;
+        return;
+    }
+    m_rates_time = std::chrono::steady_clock::now();
+    m_rates_upstream = m_upstream_bytes;
+    m_rates_downstream = m_downstream_bytes;
+    ssh_set_blocking(m_ssh, 0);
+    ssh_event_add_session(m_event, m_ssh);
+    ssh_event_add_fd(m_event, m_wakeup_read->get_fd(), POLLIN,
+                     &SshTunnel::wakeup_ready, this);
+
+    // The only timeout here is the keepalive:  Everything else we wait on,
+    // including window adjustments from the server, arrives on one of the
+    // polled fds, and disconnect() and post_command() wake us up explicitly.
+    const auto keepalive_interval = std::chrono::seconds(m_keepalive_interval);
+    auto next_keepalive = std::chrono::steady_clock::now() + keepalive_interval;
+
+    // Each keepalive asks for a reply, so when nothing at all has arrived
+    // for m_keepalive_count intervals, that many went unanswered
+    struct ssh_counter_struct received = { };
+    ssh_set_counters(m_ssh, nullptr, &received);
+    const auto silence_limit = keepalive_interval * m_keepalive_count;
+    auto last_received = std::chrono::steady_clock::now();
+    uint64_t last_received_bytes = 0;
+
+    while (!m_eof) {
+        int timeout = -1;
+        if (m_keepalive_interval > 0) {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= next_keepalive) {
+                // Keeps data in flight on an idle link, so a dead peer is
+                // caught by TCP_USER_TIMEOUT rather than minutes later
+                ssh_send_keepalive(m_ssh);
+                next_keepalive = now + keepalive_interval;
             }
-            if (ssh_channel_is_closed(client->m_channel))
-                client = clients.erase(client);
-            else
-                ++client;
+            timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                            next_keepalive - now).count());
         }
+        if (m_holding_batches) {
+            // Rounded up, since poll() counts whole milliseconds
+            auto until_due = std::chrono::duration_cast<std::chrono::microseconds>(
+                                    m_batch_deadline - std::chrono::steady_clock::now());
+            int batch_timeout = std::max(0, static_cast<int>((until_due.count() + 999) / 1000));
+            if (timeout < 0 || timeout > batch_timeout)
+                timeout = batch_timeout;
+        }
+        if (m_downstream_backlog)
+            timeout = 0;
+
+        // Wake up to bring the rates back down once traffic stops
+        if (m_upstream_rate || m_downstream_rate) {
+            const int rate_timeout = static_cast<int>(STATS_RATE_INTERVAL.count());
+            if (timeout < 0 || timeout > rate_timeout)
+                timeout = rate_timeout;
+        }
+
+        int result;
+        {
+            ScopeTimer timer(m_poll_usec);
+            result = ssh_event_dopoll(m_event, timeout);
+        }
+        add_counter(m_wakeups, 1);
+        auto now = std::chrono::steady_clock::now();
+        update_rates(now);
+        if (received.in_bytes != last_received_bytes) {
+            last_received_bytes = received.in_bytes;
+            last_received = now;
+        }
+        if ((result == SSH_ERROR || m_keepalive_interval > 0) && !ssh_is_connected(m_ssh)) {
+            std::cerr << "SSH connection lost: "
+                      << ssh_get_error(m_ssh) << std::endl;
+            transport_lost((ssh_get_status(m_ssh) & SSH_CLOSED_ERROR) ? LINK_ERROR : LINK_CLOSED,
+                           ssh_get_error(m_ssh));
+            break;
+        }
+        if (m_keepalive_interval > 0 && m_keepalive_count > 0
+                && now - last_received > silence_limit) {
+            auto message = Glib::ustring::compose("No reply to %1 keepalives",
+                                                  m_keepalive_count);
+            std::cerr << "SSH connection lost: " << message << std::endl;
+            transport_lost(LINK_TIMEOUT, message);
+            break;
+        }
+        run_commands();
+        finish_opening();
+        service_clients();
+        reap_clients();
     }
+
+    for (const auto &client : m_clients)
+        close_client(client.second.get());
+    reap_clients();
+    discard_spare();
+
+    ssh_event_remove_fd(m_event, m_wakeup_read->get_fd());
+    for (const auto &forward : m_listeners)
+        ssh_event_remove_fd(m_event, forward->m_listener->get_fd());
+    m_listeners.clear();
+    ssh_event_remove_session(m_event, m_ssh);
+    ssh_event_free(m_event);
+    m_event = nullptr;
+    ssh_set_counters(m_ssh, nullptr, nullptr);
+    ssh_set_blocking(m_ssh, 1);
 }
@@ -17,47 +17,396 @@
 #ifndef _SSHTUNNEL_H
 #define _SSHTUNNEL_H
 
+#include "ringbuffer.h"
+
 #include <glibmm/ustring.h>
 #include <giomm/socket.h>
+#include <sigc++/signal.h>
 #include <libssh/libssh.h>
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace Glib
+{
+
+class Dispatcher;
+
+}
 
 namespace Gtk
 {
 
 class Window;
+class Label;
 
 }
 
+class RfbCapture;
+
 class SshTunnel
 {
 public:
     explicit SshTunnel(Gtk::Window &parent);
     ~SshTunnel();
 
-    bool connect(const Glib::ustring &server, const Glib::ustring &username);
+    // The handshake runs on a worker thread while a progress dialog keeps
+    // the UI responsive and lets the user cancel.  Prompts are still shown
+    // on the main loop.  Returns false on failure or cancellation.
+    // If interactive is false, nothing is shown or asked of the user:  There
+    // is no progress dialog, only keys and the password remembered from the
+    // last successful login are tried, and errors are just logged.
+    bool connect(const Glib::ustring &server, const Glib::ustring &username,
+                 bool interactive = true);
+
+    // Take over a session that is already connected and authenticated,
+    // without any UI.  Used by the benchmark harness, so the user's
+    // settings are ignored in favour of the defaults.
+    bool attach(ssh_session session, const Glib::ustring &server,
+                const Glib::ustring &username);
+
+    // Take over another such session to the same server, and spread new
+    // channels across it as with Main/SSHSessions.  Only before the first
+    // forward is opened.  The tunnel owns the session even if this fails.
+    bool attach_stripe(ssh_session session);
     void disconnect();
 
+    // True while the session is connected and its transport hasn't failed,
+    // so new channels can be opened without redoing the handshake
+    bool is_alive() const;
+    bool is_connected(const Glib::ustring &server, const Glib::ustring &username) const;
+
+    // Algorithm and rekey tuning applied by the next connect().
+    // PROFILE_DEFAULT leaves libssh's own preferences alone.
+    enum TransportProfile
+    {
+        PROFILE_DEFAULT,
+        PROFILE_LAN,            // Fastest cipher on this CPU, no compression
+        PROFILE_WAN,            // Light compression and regular rekeying
+        PROFILE_LOW_BANDWIDTH,  // Strong compression, e.g. for mobile links
+    };
+    void set_transport_profile(TransportProfile profile) { m_profile = profile; }
+    static TransportProfile profile_from_name(const Glib::ustring &name);
+
+    // The AEAD ciphers, ordered fastest first by a short benchmark on this
+    // CPU.  Measured on first use, then cached.
+    static std::string cipher_preference();
+
+    enum LinkFailure
+    {
+        LINK_ERROR,         // Socket or protocol error
+        LINK_TIMEOUT,       // Keepalives went unanswered
+        LINK_CLOSED,        // The server closed the connection
+    };
+
+    // Emitted on the main loop as soon as the forward thread finds the
+    // transport dead, with a description of what went wrong.
+    sigc::signal<void, LinkFailure, const Glib::ustring &> &signal_transport_lost()
+    {
+        return m_signal_transport_lost;
+    }
+
+    // Each call adds an independent forward which shares the same
+    // authenticated session.  Returns the local port, or 0 on error.
+    // A remote_host of "unix:/path" forwards to a Unix socket on the server
+    // instead, and "exec:command" runs command on the server for each
+    // connection and uses its stdin/stdout (e.g. "exec:x11vnc -inetd").
+    // In both cases remote_port is ignored.
     guint16 forward_port(const Glib::ustring &remote_host, int remote_port);
 
+    // Start a SOCKS5 proxy, which opens a new channel on this session for
+    // each CONNECT request.  It listens on a Unix socket that only the
+    // current user can access, in a private directory under the user's
+    // runtime dir.  Returns the socket's path, or an empty string on error
+    // (and always on Windows).
+    std::string forward_socks();
+
+    // True once forward_port() or forward_socks() succeeded on this session.
+    // disconnect() closes the forwards along with the session.
+    bool has_forwards() const;
+
+    // Restrict forward_port() to a range of local ports.  By default (0, 0),
+    // the OS picks any free port.
+    void set_local_port_range(guint16 first, guint16 last);
+
+    // Forward a connected local socket directly to the remote host, without
+    // a listening port.  The returned fd remains owned by the tunnel and is
+    // closed on disconnect(), so the caller should dup() it if needed.
+    // Accepts the same "unix:" and "exec:" syntax as forward_port().
+    int forward_fd(const Glib::ustring &remote_host, int remote_port);
+
+    // Record what the server sends over each later forward_fd() connection
+    // to path, for playback with RfbReplay.  The first connection is
+    // written to path itself, reconnections to "path.2", "path.3" and so on.
+    // An empty path stops recording.
+    void set_capture_path(const std::string &path);
+
+    // While a reconnect is pending, keep a channel to the target of the
+    // last forward_fd() open ahead of time, so the next forward_fd() to it
+    // doesn't wait for a round trip to the SSH server.  Only done if
+    // Main/SSHSpareChannel is set, and never for "exec:" targets.  The
+    // server sees the channel as a new connection, so it shouldn't be left
+    // waiting:  Clear the flag once the reconnect succeeds or is abandoned.
+    void set_reconnect_pending(bool pending);
+
+    // Close every fd returned by forward_fd(), which also closes their
+    // channels, but keep the session and any forwarded ports open.
+    void close_forward_fds();
+
     Glib::ustring ssh_host() const { return m_hostname; }
 
+    // A connected pair of stream sockets, which is a loopback TCP
+    // connection on Windows
+    static bool create_socket_pair(Glib::RefPtr<Gio::Socket> &first,
+                                   Glib::RefPtr<Gio::Socket> &second);
+
+    // Forwarding counters, summed over all sessions of a striped tunnel.
+    // They're updated without locks by the forward threads, so reading them
+    // from the GTK thread never blocks forwarding (nor the other way round).
+    struct Stats
+    {
+        // Upstream is local client to SSH server, downstream the reverse.
+        // The rates are measured over the last half second or so.
+        uint64_t upstream_bytes;
+        uint64_t downstream_bytes;
+        uint64_t upstream_rate;
+        uint64_t downstream_rate;
+
+        // The ratio of local_reads to channel_writes is how many socket
+        // reads were coalesced into each write to the SSH channel
+        uint64_t local_reads;
+        uint64_t channel_writes;
+
+        // Bytes buffered in either direction across all channels, and how
+        // often writing stopped because the remote window or the local
+        // socket was full
+        uint64_t queued_bytes;
+        uint64_t upstream_stalls;
+        uint64_t downstream_stalls;
+
+        // The receive window most recently advertised by auto-tuning (0 if
+        // libssh's default is in use), how many round trips were limited by
+        // the window, and the smallest round trip time seen
+        uint32_t window_size;
+        uint64_t window_stalls;
+        uint32_t rtt_usec;
+
+        uint64_t channels_opened;
+        uint64_t open_usec_total;
+
+        // Where the forward threads spend their time.  libssh decrypts
+        // inside its poll, so crypto shows up in poll_usec (along with
+        // idle waiting) and in cpu_usec, while ssh_usec covers encrypting
+        // and sending in channel writes.  cpu_usec is 0 where thread CPU
+        // time isn't available.
+        uint64_t wakeups;
+        uint64_t poll_usec;
+        uint64_t ssh_usec;
+        uint64_t local_io_usec;
+        uint64_t cpu_usec;
+    };
+    Stats stats() const;
+
+    struct ChannelStats
+    {
+        std::string target;
+        uint64_t upstream_bytes;
+        uint64_t downstream_bytes;
+        uint64_t queued_upstream;
+        uint64_t queued_downstream;
+        uint64_t upstream_stalls;
+        uint64_t downstream_stalls;
+        uint32_t window_size;
+        uint32_t open_usec;
+    };
+    std::vector<ChannelStats> channel_stats() const;
+
 private:
     Gtk::Window &m_parent;
     ssh_session m_ssh;
     Glib::ustring m_hostname;
+    Glib::ustring m_username;
     Glib::ustring m_server_desc;
-    Glib::RefPtr<Gio::Socket> m_forward_socket;
+    guint16 m_port_first, m_port_last, m_next_port;
+    std::vector<Glib::RefPtr<Gio::Socket>> m_local_sockets;
+    std::string m_capture_path;
+    int m_capture_count;
     std::thread m_forward_thread;
-    Glib::ustring m_remote_host;
-    int m_remote_port;
     std::atomic_bool m_eof;
+    std::atomic_bool m_lost;
+
+    struct PortForward;
+    std::vector<std::shared_ptr<PortForward>> m_forwards;
+
+    // Used to interrupt the forward thread's poll from other threads
+    Glib::RefPtr<Gio::Socket> m_wakeup_read;
+    Glib::RefPtr<Gio::Socket> m_wakeup_write;
+    std::mutex m_command_lock;
+    std::vector<std::function<void ()>> m_commands;
+
+    // Connection handshake state, see connect()
+    bool m_interactive;
+    Glib::ustring m_saved_password_desc;
+    Glib::ustring m_saved_password;
+    std::atomic_bool m_connect_cancel;
+    int m_connect_timeout;
+    ssh_event m_connect_event;
+    Glib::Dispatcher *m_ui_dispatcher;
+    Gtk::Label *m_progress_label;
+    std::mutex m_ui_lock;
+    std::vector<std::function<void ()>> m_ui_calls;
+
+    // Seconds between SSH keepalives (0 to disable), and how many may go
+    // unanswered before the kernel gives up on the connection
+    int m_keepalive_interval;
+    int m_keepalive_count;
+
+    // The profile to use, and the one the current session was made with
+    TransportProfile m_profile;
+    TransportProfile m_session_profile;
+
+    // With Main/SSHSessions above 1, connect() opens extra sessions to the
+    // same server, each with its own forward thread.  Forwards and their
+    // listeners stay on this tunnel, but each new channel (a forward_fd()
+    // or an accepted client) goes to the next session in turn, so
+    // encryption can use more than one core.  The stripes are only changed
+    // while the forward thread isn't running, so it can pick from them too.
+    bool m_is_stripe;
+    int m_session_count;
+    std::vector<std::unique_ptr<SshTunnel>> m_stripes;
+    std::atomic<size_t> m_next_stripe;
+
+    // Set by the forward thread under m_command_lock
+    LinkFailure m_lost_reason;
+    Glib::ustring m_lost_message;
+    std::unique_ptr<Glib::Dispatcher> m_lost_dispatcher;
+    sigc::signal<void, LinkFailure, const Glib::ustring &> m_signal_transport_lost;
 
+    // Forwarding state, owned by the forward thread
+    struct ForwardClient;
+    ssh_event m_event;
+    BufferPool m_buffer_pool;
+    std::vector<std::shared_ptr<PortForward>> m_listeners;
+    std::unordered_map<int, std::unique_ptr<ForwardClient>> m_clients;
+    std::vector<ForwardClient *> m_pending_clients;
+    std::vector<ForwardClient *> m_opening_clients;
+    std::vector<ForwardClient *> m_backlog_clients;
+    std::vector<ForwardClient *> m_coalescing_clients;
+
+    // A channel opened before anyone asked for it, for the next client that
+    // connects to the same target (see PortForward::spare_key).  Only used
+    // while a reconnect is pending, see set_reconnect_pending().
+    Glib::ustring m_last_fd_host;
+    int m_last_fd_port;
+    bool m_reconnect_pending;
+    bool m_use_spare;
+    std::unique_ptr<ForwardClient> m_spare;
+    std::string m_spare_key;
+
+    // Set while clients still have server-to-client data to move, and their
+    // local sockets are keeping up, so the next poll doesn't block
+    bool m_downstream_backlog;
+
+    // Set while bulk client-to-server data is held back to fill a packet,
+    // until the earliest of the held batches must go out
+    bool m_holding_batches;
+    std::chrono::steady_clock::time_point m_batch_deadline;
+    std::atomic<uint64_t> m_local_reads;
+    std::atomic<uint64_t> m_channel_writes;
+    std::atomic<uint64_t> m_upstream_bytes;
+
+    // Receive window auto-tuning; see ForwardClient::account_window()
+    uint32_t m_max_window;
+    std::atomic<uint32_t> m_window_size;
+    std::atomic<uint64_t> m_window_stalls;
+    std::atomic<uint32_t> m_rtt_usec;
+
+    // The rest of stats(), all written only by the forward thread
+    std::atomic<uint64_t> m_downstream_bytes;
+    std::atomic<uint64_t> m_upstream_rate;
+    std::atomic<uint64_t> m_downstream_rate;
+    std::atomic<uint64_t> m_upstream_stalls;
+    std::atomic<uint64_t> m_downstream_stalls;
+    std::atomic<uint64_t> m_channels_opened;
+    std::atomic<uint64_t> m_open_usec_total;
+    std::atomic<uint64_t> m_wakeups;
+    std::atomic<uint64_t> m_poll_usec;
+    std::atomic<uint64_t> m_ssh_usec;
+    std::atomic<uint64_t> m_local_io_usec;
+    std::atomic<uint64_t> m_cpu_usec;
+
+    // Per-channel counters are shared with the published channel list, which
+    // is replaced (never modified) when channels come and go, and accessed
+    // with std::atomic_load() and std::atomic_store()
+    struct ChannelCounters;
+    using ChannelList = std::vector<std::shared_ptr<ChannelCounters>>;
+    std::shared_ptr<const ChannelList> m_channel_list;
+
+    // Where update_rates() last sampled the byte counts
+    std::chrono::steady_clock::time_point m_rates_time;
+    uint64_t m_rates_upstream;
+    uint64_t m_rates_downstream;
+    std::vector<int> m_closed_clients;
+
+    void new_session(const Glib::ustring &server, const Glib::ustring &username);
+    void load_settings();
+    void apply_transport_profile();
+    void open_stripes();
+    SshTunnel *next_stripe();
+    bool connect_session();
+    bool handshake();
+    bool wait_for(int again, int &result, const std::function<int ()> &step);
+    void post_ui(std::function<void ()> call);
+    template <typename Result>
+    Result call_ui(const std::function<Result ()> &call);
+    void run_ui_calls();
+    void set_progress(const Glib::ustring &text);
+    void show_error(const Glib::ustring &text);
+
+    // Like show_error(), but for the main thread, outside of connect()
+    void report_error(const Glib::ustring &text);
     bool verify_host();
     bool prompt_password();
     bool interactive();
-    void tunnel_server(int ssh_fd);
+
+    bool start_forward(const std::shared_ptr<PortForward> &forward);
+    int forward_fd(const Glib::ustring &remote_host, int remote_port,
+                   std::unique_ptr<RfbCapture> capture);
+    bool start_forward_thread();
+    void tunnel_server();
+    void transport_lost(LinkFailure reason, const Glib::ustring &message);
+    void post_command(std::function<void ()> command);
+    void wakeup();
+    void run_commands();
+    void start_listener(const std::shared_ptr<PortForward> &forward);
+    void accept_client(PortForward *forward);
+    void add_client(const Glib::RefPtr<Gio::Socket> &socket,
+                    const std::shared_ptr<PortForward> &forward,
+                    const std::string &source_host, int source_port);
+    bool open_channel(ForwardClient *client);
+    bool open_tcp_channel(ForwardClient *client, const std::string &remote_host,
+                          int remote_port);
+    bool open_channel(ForwardClient *client, const std::string &target,
+                      std::function<int (ssh_channel)> open);
+    void finish_opening();
+    void open_spare(const std::shared_ptr<PortForward> &forward);
+    void discard_spare();
+    void queue_client(ForwardClient *client);
+    void service_clients();
+    void service_client(ForwardClient *client);
+    void update_events(ForwardClient *client);
+    void close_client(ForwardClient *client);
+    void reap_clients();
+    void publish_channels();
+    void update_rates(std::chrono::steady_clock::time_point now);
+
+    static int listener_ready(socket_t fd, int revents, void *userdata);
+    static int wakeup_ready(socket_t fd, int revents, void *userdata);
 };
 
 #endif
@@ -25,6 +25,7 @@
 #include <gtkmm/checkbutton.h>
 #include <gtkmm/comboboxtext.h>
 #include <gtkmm/switch.h>
+#include <gtkmm/messagedialog.h>
 
 Vnc::ConnectDialog::ConnectDialog(Gtk::Window &parent)
     : Gtk::Dialog("Connect - gsshvnc " GSSHVNC_VERSION_STR, parent,
@@ -49,7 +50,7 @@ Vnc::ConnectDialog::ConnectDialog(Gtk::Window &parent)
     linebox->set_margin_left(15);
     label = Gtk::manage(new Gtk::Label("VNC _Server:", true));
     m_host = Gtk::manage(new Gtk::ComboBoxText(true));
-    m_host->get_entry()->set_placeholder_text("hostname[:display]");
+    m_host->get_entry()->set_placeholder_text("hostname[:display], unix:/path or exec:command");
     m_host->get_entry()->set_activates_default(true);
     label->set_mnemonic_widget(*m_host);
 
@@ -135,6 +136,22 @@ Vnc::ConnectDialog::ConnectDialog(Gtk::Window &parent)
     linebox->pack_start(*m_ssh_user);
     box->add(*linebox);
 
+    linebox = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL, 5));
+    linebox->set_margin_left(15);
+    m_ssh_detail_labels[2] = Gtk::manage(new Gtk::Label("_Network:", true));
+    m_ssh_profile = Gtk::manage(new Gtk::ComboBoxText);
+    m_ssh_profile->append("default", "Default");
+    m_ssh_profile->append("lan", "Local Network");
+    m_ssh_profile->append("wan", "Internet");
+    m_ssh_profile->append("low-bandwidth", "Low Bandwidth (Compressed)");
+    if (!m_ssh_profile->set_active_id(settings.get_ssh_profile()))
+        m_ssh_profile->set_active(0);
+    m_ssh_detail_labels[2]->set_mnemonic_widget(*m_ssh_profile);
+
+    linebox->pack_start(*m_ssh_detail_labels[2], Gtk::PACK_SHRINK);
+    linebox->pack_start(*m_ssh_profile, Gtk::PACK_SHRINK);
+    box->add(*linebox);
+
     auto vbox = get_child();
     dynamic_cast<Gtk::Container *>(vbox)->add(*box);
 
@@ -144,16 +161,70 @@ Vnc::ConnectDialog::ConnectDialog(Gtk::Window &parent)
     m_ssh_tunnel->set_active(settings.get_enable_tunnel());
 }
 
+Vnc::ConnectParams Vnc::ConnectDialog::get_params() const
+{
+    ConnectParams params;
+    params.host = m_host->get_active_text();
+    params.use_tunnel = m_ssh_tunnel->get_active();
+    params.ssh_host = m_ssh_host->get_active_text();
+    params.ssh_user = m_ssh_user->get_active_text();
+    params.ssh_profile = m_ssh_profile->get_active_id();
+    params.lossy_compression = m_lossy_compression->get_active();
+    params.color_depth = m_color_depth->get_active_id();
+    return params;
+}
+
 bool Vnc::ConnectDialog::configure(Vnc::DisplayWindow &vnc, SshTunnel &tunnel)
+{
+    auto params = get_params();
+    if (!open_connection(vnc, tunnel, params, true))
+        return false;
+
+    AppSettings settings;
+    vnc.set_capture_keyboard(settings.get_capture_keyboard());
+    vnc.set_scaling(settings.get_scaled_display());
+    vnc.set_allow_resize(settings.get_allow_resize());
+    vnc.set_smoothing(settings.get_smooth_scaling());
+    vnc.set_keep_aspect_ratio(settings.get_keep_aspect_ratio());
+
+    // Save settings if the configuration was successful
+    if (!params.host.empty())
+        settings.add_recent_host(params.host);
+    if (!params.ssh_host.empty())
+        settings.add_recent_ssh_host(params.ssh_host);
+    if (!params.ssh_user.empty())
+        settings.add_recent_ssh_user(params.ssh_user);
+    settings.set_enable_tunnel(params.use_tunnel);
+    settings.set_lossy_compression(params.lossy_compression);
+    settings.set_color_depth(params.color_depth);
+    settings.set_ssh_profile(params.ssh_profile);
+
+    return true;
+}
+
+bool Vnc::ConnectDialog::open_connection(Vnc::DisplayWindow &vnc, SshTunnel &tunnel,
+                                         const ConnectParams &params, bool interactive)
 {
     vnc.set_shared_flag(true);
-    vnc.set_depth((VncDisplayDepthColor)std::stoi(m_color_depth->get_active_id()));
-    vnc.set_lossy_encoding(m_lossy_compression->get_active());
+    vnc.set_depth((VncDisplayDepthColor)std::stoi(params.color_depth));
+    vnc.set_lossy_encoding(params.lossy_compression);
 
-    Glib::ustring hostname = m_host->get_active_text();
+    Glib::ustring hostname = params.host;
     Glib::ustring port;
 
-    auto ppos = hostname.find(':');
+    // A socket path or inetd-style command on the SSH server, either of
+    // which may itself contain ':'
+    const bool remote_target = (hostname.compare(0, 5, "unix:") == 0
+                                || hostname.compare(0, 5, "exec:") == 0);
+    if (remote_target && !params.use_tunnel) {
+        Gtk::MessageDialog dialog(vnc,
+                                  "Unix socket paths and remote commands require an SSH tunnel",
+                                  false, Gtk::MESSAGE_ERROR);
+        (void)dialog.run();
+        return false;
+    }
+
+    auto ppos = remote_target ? Glib::ustring::npos : hostname.find(':');
     if (ppos != Glib::ustring::npos) {
         int port_num = std::stoi(hostname.substr(ppos + 1));
         if (port_num > 999)
@@ -169,53 +240,43 @@ bool Vnc::ConnectDialog::configure(Vnc::DisplayWindow &vnc, SshTunnel &tunnel)
         hostname = "127.0.0.1";
 
     // Reformat this for use by credential lookup/storage
-    vnc.set_vnc_host(Glib::ustring::compose("%1:%2", hostname, port));
+    if (remote_target)
+        vnc.set_vnc_host(hostname);
+    else
+        vnc.set_vnc_host(Glib::ustring::compose("%1:%2", hostname, port));
 
-    if (m_ssh_tunnel->get_active()) {
-        auto ssh_string = m_ssh_host->get_active_text();
-        auto username = m_ssh_user->get_active_text();
+    if (params.use_tunnel) {
+        auto username = params.ssh_user;
         if (username.empty())
             username = Glib::get_user_name();
-        tunnel.disconnect();
-        if (!tunnel.connect(ssh_string, username))
-            return false;
-        guint16 local_port = tunnel.forward_port(hostname, std::stoi(port));
-        if (local_port == 0)
+
+        // Reuse the existing session if it's still healthy, so reconnecting
+        // to a restarted VNC server doesn't redo the SSH handshake
+        tunnel.set_transport_profile(SshTunnel::profile_from_name(params.ssh_profile));
+        if (!tunnel.is_connected(params.ssh_host, username)) {
+            tunnel.disconnect();
+            if (!tunnel.connect(params.ssh_host, username, interactive))
+                return false;
+        }
+
+        // Hand gtk-vnc one end of a socket pair, rather than making it
+        // connect back to us through a local TCP port
+        int tunnel_fd = tunnel.forward_fd(hostname, std::stoi(port));
+        if (tunnel_fd < 0)
             return false;
-        hostname = "127.0.0.1";
-        port = std::to_string(local_port);
         vnc.set_ssh_host(tunnel.ssh_host());
+        if (!vnc.open_fd(tunnel_fd, hostname))
+            return false;
     } else {
+        tunnel.disconnect();
         vnc.set_ssh_host(Glib::ustring());
+        if (!vnc.open_host(hostname, port))
+            return false;
     }
 
-    if (!vnc.open_host(hostname, port))
-        return false;
-
     vnc.set_pointer_grab(true);
     vnc.set_pointer_local(true);
 
-    AppSettings settings;
-    vnc.set_capture_keyboard(settings.get_capture_keyboard());
-    vnc.set_scaling(settings.get_scaled_display());
-    vnc.set_allow_resize(settings.get_allow_resize());
-    vnc.set_smoothing(settings.get_smooth_scaling());
-    vnc.set_keep_aspect_ratio(settings.get_keep_aspect_ratio());
-
-    // Save settings if the configuration was successful
-    auto form_text = m_host->get_active_text();
-    if (!form_text.empty())
-        settings.add_recent_host(form_text);
-    form_text = m_ssh_host->get_active_text();
-    if (!form_text.empty())
-        settings.add_recent_ssh_host(form_text);
-    form_text = m_ssh_user->get_active_text();
-    if (!form_text.empty())
-        settings.add_recent_ssh_user(form_text);
-    settings.set_enable_tunnel(m_ssh_tunnel->get_active());
-    settings.set_lossy_compression(m_lossy_compression->get_active());
-    settings.set_color_depth(m_color_depth->get_active_id());
-
     return true;
 }
 
@@ -230,5 +291,7 @@ gboolean Vnc::ConnectDialog::ssh_switch_activate(GtkSwitch *, gboolean active,
     self->m_ssh_detail_labels[1]->set_sensitive(active);
     self->m_ssh_user->set_sensitive(active);
     self->m_ssh_user->get_entry()->set_sensitive(active);
+    self->m_ssh_detail_labels[2]->set_sensitive(active);
+    self->m_ssh_profile->set_sensitive(active);
     return false;
 }
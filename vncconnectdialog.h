@@ -36,19 +36,38 @@ namespace Vnc
 
 class DisplayWindow;
 
+// Everything needed to open a connection again without the dialog
+struct ConnectParams
+{
+    Glib::ustring host;
+    bool use_tunnel;
+    Glib::ustring ssh_host;
+    Glib::ustring ssh_user;
+    Glib::ustring ssh_profile;
+    bool lossy_compression;
+    Glib::ustring color_depth;
+};
+
 class ConnectDialog : public Gtk::Dialog
 {
 public:
     explicit ConnectDialog(Gtk::Window &parent);
 
+    ConnectParams get_params() const;
     bool configure(Vnc::DisplayWindow &vnc, SshTunnel &tunnel);
 
+    // Open the connection described by params.  Unless interactive is set,
+    // SSH authentication only uses remembered credentials.
+    static bool open_connection(Vnc::DisplayWindow &vnc, SshTunnel &tunnel,
+                                const ConnectParams &params, bool interactive);
+
 private:
     Gtk::ComboBoxText *m_host;
     Gtk::Switch *m_ssh_tunnel;
-    Gtk::Label *m_ssh_detail_labels[2];
+    Gtk::Label *m_ssh_detail_labels[3];
     Gtk::ComboBoxText *m_ssh_host;
     Gtk::ComboBoxText *m_ssh_user;
+    Gtk::ComboBoxText *m_ssh_profile;
     Gtk::CheckButton *m_lossy_compression;
     Gtk::ComboBoxText *m_color_depth;
 
@@ -17,15 +17,19 @@
 #include "vncdisplaymm.h"
 #include "appsettings.h"
 #include "credstorage.h"
+#include "sessionrecording.h"
 
 #include <glibmm/exceptionhandler.h>
 #include <glibmm/convert.h>
+#include <glibmm/dispatcher.h>
 #include <giomm/socketaddress.h>
 #include <gtkmm/box.h>
 #include <gtkmm/grid.h>
 #include <gtkmm/scrolledwindow.h>
 #include <gtkmm/entry.h>
 #include <gtkmm/checkbutton.h>
+#include <gtkmm/label.h>
+#include <gtkmm/spinbutton.h>
 #include <gtkmm/menubar.h>
 #include <gtkmm/checkmenuitem.h>
 #include <gtkmm/radiomenuitem.h>
@@ -34,10 +38,17 @@
 #include <gtkmm/filechooserdialog.h>
 #include <gtkmm/messagedialog.h>
 #include <gtkmm/aboutdialog.h>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <thread>
 #include <ctime>
 
+// How often the framebuffer is sampled for session recording, when it
+// has changed
+#define RECORDING_INTERVAL_MS   200
+
 #ifdef HAVE_PULSEAUDIO
 #include <vncaudiopulse.h>
 #endif
@@ -56,14 +67,27 @@ static gboolean _activate_menubar(Vnc::DisplayWindow *self, GtkAccelGroup *,
     return TRUE;
 }
 
+struct Vnc::DisplayWindow::ScreenshotJob
+{
+    std::thread m_thread;
+    std::string m_filename;
+    Glib::ustring m_error;
+    std::atomic_bool m_done;
+
+    ScreenshotJob() : m_done(false) { }
+};
+
 Vnc::DisplayWindow::DisplayWindow()
-    : m_vnc(), m_connected(false), m_accel_enabled(true), m_enable_mnemonics()
+    : m_vnc(), m_connected(false), m_auto_reconnecting(false), m_saved_width(-1),
+      m_saved_height(-1), m_accel_enabled(true), m_enable_mnemonics(),
+      m_screenshot_done(new Glib::Dispatcher)
 {
     if (s_instance) {
         std::cerr << "WARNING: Creating multiple Vnc::DisplayWindow instances is not supported"
                   << std::endl;
     }
     s_instance = this;
+    m_screenshot_done->connect(sigc::mem_fun(this, &DisplayWindow::finish_screenshots));
 
     set_default_icon_name("preferences-desktop-remote-desktop");
 
@@ -86,12 +110,14 @@ Vnc::DisplayWindow::DisplayWindow()
     auto submenu = Gtk::manage(new Gtk::Menu);
 
     m_capture_keyboard = Gtk::manage(new Gtk::CheckMenuItem("Capture All _Keyboard Input", true));
+    m_auto_reconnect = Gtk::manage(new Gtk::CheckMenuItem("Reconnect _Automatically", true));
     auto send_f8 = Gtk::manage(new Gtk::MenuItem("Send F8", true));
     auto send_cad = Gtk::manage(new Gtk::MenuItem("Send Ctrl+Alt+_Del", true));
     auto screenshot = Gtk::manage(new Gtk::MenuItem("Take _Screenshot", true));
     auto appquit = Gtk::manage(new Gtk::MenuItem("_Quit", true));
 
     submenu->append(*m_capture_keyboard);
+    submenu->append(*m_auto_reconnect);
     submenu->append(*send_f8);
     submenu->append(*send_cad);
     submenu->append(*Gtk::manage(new Gtk::SeparatorMenuItem));
@@ -169,6 +195,7 @@ Vnc::DisplayWindow::DisplayWindow()
     add(*layout);
 
     AppSettings settings;
+    m_auto_reconnect->set_active(settings.get_auto_reconnect());
     auto saved_size = settings.get_window_size();
     if (saved_size != std::make_tuple(-1, -1)) {
         set_default_size(std::get<0>(saved_size), std::get<1>(saved_size));
@@ -188,6 +215,10 @@ Vnc::DisplayWindow::DisplayWindow()
         AppSettings settings;
         settings.set_capture_keyboard(enable);
     });
+    m_auto_reconnect->signal_toggled().connect([this]() {
+        AppSettings settings;
+        settings.set_auto_reconnect(m_auto_reconnect->get_active());
+    });
     send_cad->signal_activate().connect([this]() {
         send_keys({ GDK_KEY_Control_L, GDK_KEY_Alt_L, GDK_KEY_Delete });
     });
@@ -312,6 +343,10 @@ Vnc::DisplayWindow::DisplayWindow()
 
 Vnc::DisplayWindow::~DisplayWindow()
 {
+    // Let screenshots in progress finish, rather than leave partial files
+    for (auto &job : m_screenshot_jobs)
+        job->m_thread.join();
+    stop_recording();
     s_instance = nullptr;
 }
 
@@ -347,6 +382,33 @@ void Vnc::DisplayWindow::close_vnc()
     vnc_display_close(get_vnc());
 }
 
+void Vnc::DisplayWindow::restore_session_state()
+{
+    // The menu items still reflect the previous connection's settings
+    set_capture_keyboard(m_capture_keyboard->get_active());
+    set_scaling(m_resize_scale->get_active());
+#if VNC_CHECK_VERSION(1, 2, 0)
+    set_allow_resize(m_resize_remote->get_active());
+    set_keep_aspect_ratio(m_keep_ratio->get_active());
+#endif
+#ifdef GTK_VNC_HAVE_SMOOTH_SCALING
+    set_smoothing(m_smoothing->get_active());
+#endif
+
+    if (m_saved_width > 0 && m_saved_height > 0)
+        resize(m_saved_width, m_saved_height);
+}
+
+void Vnc::DisplayWindow::transport_lost(const Glib::ustring &message)
+{
+    if (!m_vnc || !is_open())
+        return;
+
+    // handle_disconnect() will pick this up from the disconnected signal
+    m_disconnect_reason = message;
+    close_vnc();
+}
+
 void Vnc::DisplayWindow::send_keys(const std::vector<guint> &keys)
 {
     vnc_display_send_keys(get_vnc(), keys.data(), static_cast<int>(keys.size()));
@@ -915,6 +977,11 @@ void Vnc::DisplayWindow::init_vnc()
     m_viewport->remove();
     m_viewport->add(*m_vnc);
 
+    // The connection lives as long as the display, so this never has to be
+    // disconnected
+    g_signal_connect(vnc_display_get_connection(get_vnc()), "vnc-framebuffer-update",
+                     G_CALLBACK(&DisplayWindow::vnc_framebuffer_update), this);
+
     signal_vnc_connected().connect([this]() { m_connected = true; });
     signal_vnc_initialized().connect(sigc::mem_fun(this, &DisplayWindow::vnc_initialized));
     signal_vnc_disconnected().connect([this]() {
@@ -959,20 +1026,85 @@ void Vnc::DisplayWindow::init_vnc()
     }
 }
 
+bool Vnc::DisplayWindow::start_recording(const std::string &path)
+{
+    stop_recording();
+    m_recorder = std::make_unique<SessionRecorder>();
+    if (!m_recorder->open(path)) {
+        m_recorder.reset();
+        return false;
+    }
+
+    // Whatever is on screen already goes into the first keyframe
+    if (m_connected)
+        m_recorder->add_damage(0, 0, get_width(), get_height());
+    m_recording_timer = Glib::signal_timeout().connect([this]() {
+        record_frame();
+        return true;
+    }, RECORDING_INTERVAL_MS);
+    return true;
+}
+
+void Vnc::DisplayWindow::stop_recording()
+{
+    m_recording_timer.disconnect();
+    m_recorder.reset();
+}
+
+void Vnc::DisplayWindow::record_frame()
+{
+    if (!m_connected || !m_recorder->has_damage())
+        return;
+
+    // gtk-vnc only hands out its framebuffer as a copy, so that copy is all
+    // that happens here; the recorder picks out the damage and compresses
+    // it on its own thread.  Null until the server has sent its size.
+    auto framebuffer = get_pixbuf();
+    if (framebuffer)
+        m_recorder->add_frame(framebuffer);
+}
+
+void Vnc::DisplayWindow::vnc_framebuffer_update(VncConnection *, int x, int y,
+                                                int width, int height, gpointer user_data)
+{
+    auto self = reinterpret_cast<Vnc::DisplayWindow *>(user_data);
+    if (self->m_recorder)
+        self->m_recorder->add_damage(x, y, width, height);
+}
+
 void Vnc::DisplayWindow::handle_disconnect(const Glib::ustring &connected_msg,
                                            const Glib::ustring &disconnected_msg)
 {
+    Glib::ustring reason;
+    std::swap(reason, m_disconnect_reason);
+
     m_signal_connection_lost.emit();
-    if (m_connected) {
+    if ((m_connected || m_auto_reconnecting) && m_auto_reconnect->get_active()) {
+        std::cerr << (reason.empty() ? connected_msg : reason)
+                  << ", reconnecting automatically" << std::endl;
+        if (m_connected)
+            get_size(m_saved_width, m_saved_height);
+        delete m_vnc;
+        m_vnc = nullptr;
+        m_connected = false;
+        m_auto_reconnecting = true;
+        m_signal_auto_reconnect.emit();
+        return;
+    }
+
+    if (m_connected || m_auto_reconnecting) {
+        m_auto_reconnecting = false;
         int result = Gtk::RESPONSE_CANCEL;
         {
-            Gtk::MessageDialog dialog(*this, connected_msg, false,
+            Gtk::MessageDialog dialog(*this, reason.empty() ? connected_msg : reason, false,
                                       Gtk::MESSAGE_ERROR, Gtk::BUTTONS_NONE);
             dialog.add_button("Reconnect", Gtk::RESPONSE_YES);
             dialog.add_button("Close", Gtk::RESPONSE_CANCEL);
             dialog.set_default_response(Gtk::RESPONSE_YES);
             result = dialog.run();
         }
+        if (m_connected)
+            get_size(m_saved_width, m_saved_height);
         delete m_vnc;
         m_vnc = nullptr;
         m_connected = false;
@@ -982,7 +1114,7 @@ void Vnc::DisplayWindow::handle_disconnect(const Glib::ustring &connected_msg,
         else
             get_application()->quit();
     } else {
-        Gtk::MessageDialog dialog(*this, disconnected_msg, false,
+        Gtk::MessageDialog dialog(*this, reason.empty() ? disconnected_msg : reason, false,
                                   Gtk::MESSAGE_ERROR);
         (void)dialog.run();
         get_application()->quit();
@@ -1006,8 +1138,44 @@ static Glib::ustring gen_screenshot_name(const Glib::ustring &name)
 void Vnc::DisplayWindow::vnc_screenshot()
 {
     /* Do this right away, in case the display changes by the time we pick
-     * a filename and save it to disk. */
+     * a filename and save it to disk.  This is the only copy made of the
+     * framebuffer; a region is just a view into it. */
     auto pix = get_pixbuf();
+    if (!pix)
+        return;
+
+    // The part scrolled into view, if the desktop is larger than the window
+    int visible_x = 0, visible_y = 0;
+    int visible_width = pix->get_width(), visible_height = pix->get_height();
+    if (m_resize_none->get_active()) {
+        auto hadjustment = m_viewport->get_hadjustment();
+        auto vadjustment = m_viewport->get_vadjustment();
+        visible_x = std::min(static_cast<int>(hadjustment->get_value()), pix->get_width() - 1);
+        visible_y = std::min(static_cast<int>(vadjustment->get_value()), pix->get_height() - 1);
+        visible_width = std::min(static_cast<int>(hadjustment->get_page_size()),
+                                 pix->get_width() - visible_x);
+        visible_height = std::min(static_cast<int>(vadjustment->get_page_size()),
+                                  pix->get_height() - visible_y);
+    }
+    const bool partly_visible = visible_width > 0 && visible_height > 0
+                                && (visible_width < pix->get_width()
+                                    || visible_height < pix->get_height());
+
+    AppSettings settings;
+    auto options = Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL, 6));
+    auto visible_only = Gtk::manage(new Gtk::CheckButton("Only the _visible area", true));
+    visible_only->set_sensitive(partly_visible);
+    options->pack_start(*visible_only, true, true, 0);
+    auto compression_label = Gtk::manage(new Gtk::Label("Co_mpression:", true));
+    auto compression = Gtk::manage(new Gtk::SpinButton);
+    compression->set_range(0, 9);
+    compression->set_increments(1, 3);
+    compression->set_value(settings.get_screenshot_compression());
+    compression->set_tooltip_text("0 saves fastest, 9 makes the smallest files");
+    compression_label->set_mnemonic_widget(*compression);
+    options->pack_start(*compression_label, false, false, 0);
+    options->pack_start(*compression, false, false, 0);
+    options->show_all();
 
     Gtk::FileChooserDialog dialog(*this, "Save Screenshot", Gtk::FILE_CHOOSER_ACTION_SAVE);
     dialog.set_local_only(true);
@@ -1021,13 +1189,67 @@ void Vnc::DisplayWindow::vnc_screenshot()
     filter_png->set_name("PNG Files");
     filter_png->add_mime_type("image/png");
     dialog.add_filter(filter_png);
+    dialog.set_extra_widget(*options);
 
     int response = dialog.run();
     if (response == Gtk::RESPONSE_OK) {
         auto filename = dialog.get_filename();
         if (!filename.empty()) {
-            pix->save(filename, "png", {"tEXt::Generator App"}, {"gsshvnc"});
-            std::cout << "Screenshot saved to " << filename << std::endl;
+            settings.set_screenshot_compression(compression->get_value_as_int());
+            if (partly_visible && visible_only->get_active()) {
+                pix = Gdk::Pixbuf::create_subpixbuf(pix, visible_x, visible_y,
+                                                    visible_width, visible_height);
+            }
+            save_screenshot(pix, filename, compression->get_value_as_int());
+        }
+    }
+}
+
+void Vnc::DisplayWindow::save_screenshot(const Glib::RefPtr<Gdk::Pixbuf> &pixbuf,
+                                         const std::string &filename, int compression)
+{
+    // The worker thread holds the only other reference to the pixbuf, and
+    // gdk-pixbuf's PNG saver writes each row out as it's encoded
+    auto job = std::make_unique<ScreenshotJob>();
+    job->m_filename = filename;
+    auto job_ptr = job.get();
+    job->m_thread = std::thread([this, job_ptr, pixbuf, compression]() {
+        try {
+            pixbuf->save(job_ptr->m_filename, "png",
+                         {"tEXt::Generator App", "compression"},
+                         {"gsshvnc", std::to_string(compression)});
+        } catch (Glib::Error &err) {
+            job_ptr->m_error = err.what();
+        }
+        job_ptr->m_done = true;
+        m_screenshot_done->emit();
+    });
+    m_screenshot_jobs.push_back(std::move(job));
+}
+
+void Vnc::DisplayWindow::finish_screenshots()
+{
+    // Take the finished jobs out first, since the error dialog runs a
+    // nested main loop which may call this again
+    std::vector<std::unique_ptr<ScreenshotJob>> finished;
+    for (auto iter = m_screenshot_jobs.begin(); iter != m_screenshot_jobs.end(); ) {
+        if ((*iter)->m_done) {
+            (*iter)->m_thread.join();
+            finished.push_back(std::move(*iter));
+            iter = m_screenshot_jobs.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+
+    for (const auto &job : finished) {
+        if (job->m_error.empty()) {
+            std::cout << "Screenshot saved to " << job->m_filename << std::endl;
+        } else {
+            auto text = Glib::ustring::compose("Error saving screenshot: %1", job->m_error);
+            std::cerr << text << std::endl;
+            Gtk::MessageDialog dialog(*this, text, false, Gtk::MESSAGE_ERROR);
+            (void)dialog.run();
         }
     }
 }
@@ -1036,6 +1258,11 @@ void Vnc::DisplayWindow::vnc_initialized()
 {
     update_title(false);
 
+    if (m_auto_reconnecting) {
+        m_auto_reconnecting = false;
+        m_signal_reconnected.emit();
+    }
+
 #ifdef HAVE_PULSEAUDIO
     VncAudioFormat format = {
         VNC_AUDIO_FORMAT_RAW_S32,
@@ -1085,6 +1312,20 @@ void Vnc::DisplayWindow::vnc_credential(const std::vector<VncDisplayCredential>
         }
     }
 
+    // Reuse what the user entered last time when reconnecting automatically
+    if (prompt && m_auto_reconnecting) {
+        unsigned int found = 0;
+        for (size_t i = 0; i < credList.size(); ++i) {
+            auto saved = m_saved_credentials.find(credList[i]);
+            if (saved != m_saved_credentials.end()) {
+                data[i] = {saved->second, true};
+                found++;
+            }
+        }
+        if (found == prompt)
+            prompt = 0;
+    }
+
     std::unique_ptr<Gtk::Dialog> dialog;
     if (prompt) {
         AppSettings settings;
@@ -1165,6 +1406,7 @@ void Vnc::DisplayWindow::vnc_credential(const std::vector<VncDisplayCredential>
                 case VNC_DISPLAY_CREDENTIAL_USERNAME:
                 case VNC_DISPLAY_CREDENTIAL_PASSWORD:
                     data[i] = {entry[row]->get_text(), true};
+                    m_saved_credentials[credList[i]] = data[i].first;
                     break;
                 default:
                     continue;
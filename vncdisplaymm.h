@@ -22,6 +22,8 @@
 
 #include <gtkmm/applicationwindow.h>
 #include <vncdisplay.h>
+#include <memory>
+#include <unordered_map>
 
 #ifdef GTK_VNC_HAVE_VNCVERSION
     // Introduced in v1.2.0
@@ -32,6 +34,15 @@
 
 #include "vncgrabsequencemm.h"
 
+class SessionRecorder;
+
+namespace Glib
+{
+
+class Dispatcher;
+
+}
+
 namespace Gio
 {
 
@@ -65,6 +76,11 @@ public:
     bool is_open();
     void close_vnc();
 
+    // Close the VNC connection because its transport (e.g. the SSH tunnel)
+    // is known to be dead, reporting message instead of waiting for gtk-vnc
+    // to time out on its own.
+    void transport_lost(const Glib::ustring &message);
+
     //VncConnection *get_connection();
 
     // For use in credential storage.
@@ -137,10 +153,24 @@ public:
 
     sigc::signal<void> &signal_connection_lost() { return m_signal_connection_lost; }
     sigc::signal<void> &signal_want_reconnect() { return m_signal_reconnect; }
+    sigc::signal<void> &signal_auto_reconnect() { return m_signal_auto_reconnect; }
+    sigc::signal<void> &signal_reconnected() { return m_signal_reconnected; }
+
+    // Give up on automatic reconnection, so the next failure is reported
+    void stop_auto_reconnect() { m_auto_reconnecting = false; }
+
+    // Re-apply the display settings and window size from before the last
+    // disconnect to a newly opened connection
+    void restore_session_state();
 
     void set_capture_keyboard(bool enable=true);
     bool get_capture_keyboard();
 
+    // Record what the display shows to path for later review, across
+    // reconnections, until stop_recording() or the window is destroyed
+    bool start_recording(const std::string &path);
+    void stop_recording();
+
     void activate_menubar();
 
 private:
@@ -169,10 +199,22 @@ private:
     // Emitted after VNC disconnects and the user requests re-connection.
     sigc::signal<void> m_signal_reconnect;
 
+    // Emitted instead of prompting the user when automatic reconnection is
+    // enabled, once for each attempt that should be scheduled.
+    sigc::signal<void> m_signal_auto_reconnect;
+
+    // Emitted when an automatic reconnection attempt succeeds.
+    sigc::signal<void> m_signal_reconnected;
+
     Gtk::Widget *m_vnc;
     Gtk::ScrolledWindow *m_viewport;
     VncDisplay *get_vnc();
     bool m_connected;
+    bool m_auto_reconnecting;
+
+    // Kept across reconnects, so they don't need user interaction
+    int m_saved_width, m_saved_height;
+    std::unordered_map<int, Glib::ustring> m_saved_credentials;
 
     bool m_accel_enabled;
     bool m_enable_mnemonics;
@@ -180,6 +222,7 @@ private:
 
     Gtk::MenuBar *m_menubar;
     Gtk::CheckMenuItem *m_capture_keyboard;
+    Gtk::CheckMenuItem *m_auto_reconnect;
     Gtk::CheckMenuItem *m_hide_menubar;
     Gtk::CheckMenuItem *m_fullscreen;
     Gtk::RadioMenuItem *m_resize_none;
@@ -195,11 +238,29 @@ private:
     Glib::ustring m_vnc_host;
     Glib::ustring m_ssh_host;
 
+    // Overrides the message shown by the next handle_disconnect()
+    Glib::ustring m_disconnect_reason;
+
+    std::unique_ptr<SessionRecorder> m_recorder;
+    sigc::connection m_recording_timer;
+    void record_frame();
+    static void vnc_framebuffer_update(VncConnection *, int x, int y, int width, int height,
+                                       gpointer user_data);
+
     void init_vnc();
     void handle_disconnect(const Glib::ustring &connected_msg,
                            const Glib::ustring &disconnected_msg);
 
     void vnc_screenshot();
+
+    // PNG encoding runs on worker threads, so saving a screenshot of a
+    // large desktop doesn't stall the display
+    struct ScreenshotJob;
+    std::vector<std::unique_ptr<ScreenshotJob>> m_screenshot_jobs;
+    std::unique_ptr<Glib::Dispatcher> m_screenshot_done;
+    void save_screenshot(const Glib::RefPtr<Gdk::Pixbuf> &pixbuf, const std::string &filename,
+                         int compression);
+    void finish_screenshots();
     void vnc_initialized();
     void update_title(bool grabbed);
     void vnc_credential(const std::vector<VncDisplayCredential> &credList);